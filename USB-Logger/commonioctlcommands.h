@@ -1,6 +1,355 @@
+//This header is shared between the module and userspace tools, so we only use fixed-size types here
+#ifndef COMMONIOCTLCOMMANDS_H
+#define COMMONIOCTLCOMMANDS_H
+
+#include <linux/types.h>
+
+//Every USB event is kept as one of these fixed-size binary records, 64 bytes each
+//This is their format in the rings and for readers, the in-memory archive keeps them packed
+//There are no strings in the log anymore, formatting happens only on the read path
+//Bus events only fill busnum, the other device fields stay zero
+#define USBLOG_DEVPATH_LEN	16
+struct usblog_record{
+	__u64 seq;		//Global sequence number of the event, zero means an empty slot
+	__u64 timestamp;	//CLOCK_BOOTTIME of the event in nanoseconds, signed: negative for a replayed record of an earlier boot
+	__u16 vendor;		//idVendor of the device
+	__u16 product;		//idProduct of the device
+	__u8 action;		//One of the USBLOG_ACTION_* values
+	__u8 dev_class;		//bDeviceClass of the device
+	__u8 flags;		//USBLOG_FLAG_* values
+	__u8 speed;		//enum usb_device_speed of the device, like 3 for high speed
+	__u16 busnum;		//Number of the USB bus
+	__u8 devnum;		//Address of the device on its bus
+	__u8 reserved;
+	__u32 serial_hash;	//jhash of the serial number string, zero if the device has none
+	__u32 intf_classes;	//Bit n is set for an interface of class n below 31, bit 31 for all the other classes
+	char devpath[USBLOG_DEVPATH_LEN];	//Port path on the bus like "1.4", not always terminated
+	//A device that keeps coming and going is folded into one aggregated record for each storm
+	//Then the record is the last event of the storm, with USBLOG_FLAG_FLAPPING and these two set
+	__u32 repeats;		//Events folded into this record, zero for a normal record
+	__u64 first_ts;		//CLOCK_BOOTTIME of the first folded event, signed like timestamp
+};
+
+//Interface classes of a record are a bitmap, the classes that do not fit share the last bit
+#define USBLOG_INTF_OTHER	31
+
+//These are the flags of a record
+#define USBLOG_FLAG_BLOCKED	0x01	//The device matched a rule of the blocklist
+#define USBLOG_FLAG_REJECTED	0x02	//The device has been deauthorized because of the blocklist
+#define USBLOG_FLAG_REPLAYED	0x04	//The record has been read back from the journal when the module was loaded
+#define USBLOG_FLAG_FLAPPING	0x10	//The record stands for repeats events of a flapping device, see coalesce_window_ms
+
+//These are the actions that could be stored in a record
+#define USBLOG_ACTION_DEVICE_ADD	1
+#define USBLOG_ACTION_DEVICE_REMOVE	2
+#define USBLOG_ACTION_BUS_ADD		3
+#define USBLOG_ACTION_BUS_REMOVE	4
+
+//The optional journal file is an array of fixed-size segments, each one is a header and its records
+//Segments are reused round robin, the one with the highest generation is the newest
+//crc is the CRC-32 (as zlib computes it) of the header with crc set to zero followed by count records
+#define USBLOG_JOURNAL_MAGIC		0x55534A4E
+#define USBLOG_JOURNAL_VERSION		2
+#define USBLOG_JOURNAL_SEGMENT_SIZE	4096
+struct usblog_journal_segment{
+	__u32 magic;		//USBLOG_JOURNAL_MAGIC
+	__u32 version;		//USBLOG_JOURNAL_VERSION
+	__u64 generation;	//Increases by one for every new segment
+	__s64 boot_to_real;	//Wall-clock time minus boot time in nanoseconds when the records were written
+	__u32 count;		//Valid records in this segment
+	__u32 crc;
+	struct usblog_record records[];
+};
+#define USBLOG_JOURNAL_RECORDS ((USBLOG_JOURNAL_SEGMENT_SIZE - sizeof(struct usblog_journal_segment)) / sizeof(struct usblog_record))
+
+//A blocklist rule, devices are matched on vendor:product and optionally on class and serial number
+#define USBLOG_SERIAL_LEN	32
+#define USBLOG_RULE_CLASS	0x01	//dev_class has to match too, for a device of class 0 one of its interfaces is enough
+#define USBLOG_RULE_SERIAL	0x02	//serial has to match too
+
+struct usblog_rule_spec{
+	__u16 vendor;
+	__u16 product;
+	__u8 dev_class;
+	__u8 flags;		//USBLOG_RULE_* values
+	__u8 reserved[2];
+	char serial[USBLOG_SERIAL_LEN];
+};
+
+//A whole rule set could be loaded at once by writing a batch to /proc/blockedusb or with IOCTL_DEV_LOAD
+//The batch is this header followed by count rules, they replace the blocklist in one step or not at all
+//The hit counters of the new rules start from zero
+#define USBLOG_BATCH_MAGIC	0x55534252
+#define USBLOG_BATCH_VERSION	1
+#define USBLOG_BATCH_CHECK	0x01	//Only validate the batch, the blocklist is not changed
+struct usblog_rule_batch{
+	__u32 magic;		//USBLOG_BATCH_MAGIC
+	__u32 version;		//USBLOG_BATCH_VERSION
+	__u32 count;		//Rules after this header
+	__u32 flags;		//USBLOG_BATCH_* values
+	//IOCTL_DEV_LOAD fills these in, write() only returns the error
+	__u32 loaded;		//Rules in the new blocklist
+	__u32 duplicates;	//Rules which were the same as an earlier one in the batch
+	__u32 error_index;	//The first rule that could not be loaded, or count
+	__s32 error;		//Zero or the negative error code of the batch
+	struct usblog_rule_spec rules[];
+};
+
+//IOCTL_DEV_HITS looks up the rule in spec and returns how many devices it has matched
+struct usblog_rule_hits{
+	struct usblog_rule_spec spec;
+	__u64 hits;
+};
+
+//The event rings could be mapped read-only by mmap on /proc/usblogger
+//The mapping starts with this header, and the rings follow it at data_offset
+//Ring i holds ring_size records starting at data_offset + i * ring_size * record_size
+#define USBLOG_RING_MAGIC	0x55534C47
+#define USBLOG_RING_VERSION	2
+
+//Each ring head sits on its own cache line so writers on different CPUs do not disturb each other
+//A reader that wants every record up to head_seq should first read head_seq and then wait
+//until busy is zero (or head has moved) on every ring, after that nothing older is still in flight
+struct usblog_ring_head{
+	__u64 head;		//Number of records ever written on this ring, the slot is head & (ring_size - 1)
+	__u64 busy;		//Non-zero while a writer is between taking a sequence number and publishing it
+	__u64 pad[6];
+};
+
+struct usblog_ring_header{
+	__u32 magic;		//USBLOG_RING_MAGIC
+	__u32 version;		//USBLOG_RING_VERSION
+	__u32 nr_rings;		//One ring for each possible CPU
+	__u32 ring_size;	//Records per ring, always a power of two
+	__u32 record_size;	//sizeof(struct usblog_record)
+	__u32 reserved;
+	__u64 data_offset;	//Byte offset of the first ring from the start of the mapping
+	__u64 head_seq;		//Sequence number of the latest event that has been started
+	__u64 tail_seq;		//Records with a lower sequence number have been discarded
+	__u8 pad[16];
+	struct usblog_ring_head heads[];
+};
+
+
+//IOCTL_LOG_STATS fills this structure in one call, version tells which fields are valid
+#define USBLOG_STATS_VERSION	2
+struct usblog_log_stats{
+	__u32 version;		//USBLOG_STATS_VERSION of the kernel that filled it
+	__u32 esize;		//sizeof(struct usblog_record)
+	__u64 count;		//Records which are currently in the log
+	__u64 space;		//Records that could be added before the oldest one is evicted
+	__u64 size;		//Capacity of the log in records
+	__u32 full;
+	__u32 empty;
+	__u64 events;		//Events recorded since the module was loaded
+	__u64 evicted;		//Records dropped for the retention limit, or overwritten before they were archived
+	__u64 dropped;		//Notifications which could not be recorded
+	__u64 head_seq;		//Sequence number of the latest event
+	__u64 tail_seq;		//Records before this sequence number have been discarded
+	//Since version 2, the log has a hot tier of per-CPU rings and a cold tier of page chunks
+	__u64 ring_size;	//Records all rings could hold
+	__u64 ring_bytes;	//Memory of the rings and their header
+	__u64 retention;	//Records the cold tier keeps at most
+	__u64 archive_count;	//Records in the cold tier, including discarded ones which are not freed yet
+	__u64 archive_chunks;	//Chunks in the cold tier
+	__u64 archive_packed;	//Chunks which are compressed
+	__u64 archive_bytes;	//Memory of the cold tier
+};
+
+//IOCTL_DEV_STATS does the same for the blocklist
+struct usblog_dev_stats{
+	__u32 version;		//USBLOG_STATS_VERSION of the kernel that filled it
+	__u32 esize;		//sizeof(struct usblog_rule_spec)
+	__u32 count;		//Rules in the blocklist
+	__u32 space;		//Rules that could still be added
+	__u32 size;		//Capacity of the blocklist
+	__u32 full;
+	__u32 empty;
+	__u32 reserved;
+	__u64 matched;		//Devices that matched a rule
+	__u64 rejected;		//Devices that have been deauthorized
+};
+
+//IOCTL_LOG_DRAIN copies up to max records with a sequence number of cursor or later into records
+//On return cursor is where the next call should continue, so nothing is lost or returned twice
+#define USBLOG_DRAIN_MAX	4096
+#define USBLOG_DRAIN_CONSUME	0x01	//Discard the returned records from the log too (needs CAP_SYS_ADMIN)
+struct usblog_drain{
+	__u64 records;		//User pointer to an array of max struct usblog_record
+	__u64 cursor;		//In: first sequence number wanted, out: next sequence number to ask for
+	__u32 max;		//Room in records, at most USBLOG_DRAIN_MAX
+	__u32 flags;		//USBLOG_DRAIN_* values
+	__u32 count;		//Out: records copied
+	__u32 reserved;
+	__u64 lost;		//Out: records after cursor which had already been evicted or discarded
+};
+
+//IOCTL_LOG_QUERY copies only the records that match all the fields selected in match
+//The scan starts at cursor, and on return cursor is where the next call should continue
+//since and until are boot times in nanoseconds (CLOCK_BOOTTIME), like the timestamp of the records
+//They are compared as signed numbers, the records replayed from the journal of an earlier boot are before zero
+#define USBLOG_QUERY_VENDOR	0x01
+#define USBLOG_QUERY_PRODUCT	0x02
+#define USBLOG_QUERY_CLASS	0x04	//Devices of class 0 match by the classes of their interfaces too
+#define USBLOG_QUERY_ACTION	0x08
+#define USBLOG_QUERY_SINCE	0x10
+#define USBLOG_QUERY_UNTIL	0x20
+struct usblog_query{
+	__u64 records;		//User pointer to an array of max struct usblog_record
+	__u64 cursor;		//In: first sequence number to look at, out: next sequence number to ask for
+	__s64 since;		//Oldest timestamp wanted
+	__s64 until;		//Newest timestamp wanted
+	__u32 match;		//USBLOG_QUERY_* values
+	__u32 max;		//Room in records, at most USBLOG_DRAIN_MAX
+	__u16 vendor;
+	__u16 product;
+	__u8 dev_class;
+	__u8 action;		//USBLOG_ACTION_* value
+	__u8 reserved[2];
+	__u32 count;		//Out: records copied
+	__u32 reserved2;
+	__u64 scanned;		//Out: records which had to be looked at, the others were skipped by the index
+};
+
+//The per-device table pairs every attach with its detach, IOCTL_LOG_DEVICES copies it in one call
+//A device is identified by vendor:product and the port it is plugged in, like "1-1.4" is bus 1 port path 1.4
+//Times are boot times in nanoseconds, an attach shortly after a detach of the same device is a flap
+struct usblog_device_stats{
+	__u16 vendor;
+	__u16 product;
+	__u16 busnum;
+	__u8 attached;		//Non-zero while the device is plugged in
+	__u8 reserved;
+	char devpath[USBLOG_DEVPATH_LEN];
+	__u64 attaches;
+	__u64 detaches;
+	__u64 flaps;		//Attaches within flap_window_ms of the previous detach
+	__u64 first_seen;
+	__u64 last_attach;
+	__u64 last_detach;
+	__u64 total_dwell;	//Time the device stayed plugged in, summed over all completed attaches
+	__u64 last_dwell;
+};
+
+struct usblog_device_list{
+	__u64 devices;		//User pointer to an array of max struct usblog_device_stats
+	__u32 max;		//Room in devices
+	__u32 count;		//Out: entries copied
+	__u32 total;		//Out: devices in the table
+	__u32 untracked;	//Out: devices that did not fit in the table
+};
+
+//Every new record is also sent once to the "events" multicast group of the "USBLOGGER" Generic Netlink family
+//The same family answers statistics requests and manages the blocklist (which needs CAP_NET_ADMIN)
+#define USBLOG_GENL_NAME	"USBLOGGER"
+#define USBLOG_GENL_VERSION	1
+#define USBLOG_GENL_MCGRP	"events"
+
+enum usblog_genl_cmd{
+	USBLOG_CMD_UNSPEC,
+	USBLOG_CMD_EVENT,		//Multicast, one record in the USBLOG_ATTR_EV_* attributes
+	USBLOG_CMD_GET_STATS,		//Reply has USBLOG_ATTR_LOG_STATS, USBLOG_ATTR_DEV_STATS and the netlink counters
+	USBLOG_CMD_BLOCK_ADD,		//Add the rule in USBLOG_ATTR_RULE
+	USBLOG_CMD_BLOCK_DEL,		//Remove the rule in USBLOG_ATTR_RULE
+	USBLOG_CMD_BLOCK_RESET,		//Remove every rule
+	__USBLOG_CMD_MAX,
+};
+#define USBLOG_CMD_MAX (__USBLOG_CMD_MAX - 1)
+
+enum usblog_genl_attr{
+	USBLOG_ATTR_UNSPEC,
+	USBLOG_ATTR_PAD,
+	USBLOG_ATTR_EV_SEQ,		//u64
+	USBLOG_ATTR_EV_TIMESTAMP,	//u64, boot time in nanoseconds
+	USBLOG_ATTR_EV_VENDOR,		//u16
+	USBLOG_ATTR_EV_PRODUCT,		//u16
+	USBLOG_ATTR_EV_ACTION,		//u8, USBLOG_ACTION_* value
+	USBLOG_ATTR_EV_CLASS,		//u8, bDeviceClass
+	USBLOG_ATTR_EV_FLAGS,		//u8, USBLOG_FLAG_* values
+	USBLOG_ATTR_EV_BUSNUM,		//u16
+	USBLOG_ATTR_EV_DEVPATH,		//string
+	USBLOG_ATTR_EV_SPEED,		//u8
+	USBLOG_ATTR_EV_SERIAL_HASH,	//u32
+	USBLOG_ATTR_EV_INTF_CLASSES,	//u32
+	USBLOG_ATTR_LOG_STATS,		//struct usblog_log_stats
+	USBLOG_ATTR_DEV_STATS,		//struct usblog_dev_stats
+	USBLOG_ATTR_NL_SENT,		//u64, events multicast to at least one subscriber
+	USBLOG_ATTR_NL_DROPPED,		//u64, events that could not be built or overran a subscriber's socket
+	USBLOG_ATTR_RULE,		//struct usblog_rule_spec
+	USBLOG_ATTR_EV_REPEATS,		//u32, only in aggregated records of a flapping device
+	USBLOG_ATTR_EV_FIRST_TS,	//u64, with USBLOG_ATTR_EV_REPEATS
+	__USBLOG_ATTR_MAX,
+};
+#define USBLOG_ATTR_MAX (__USBLOG_ATTR_MAX - 1)
+
+//IOCTL_LOG_TOPOLOGY copies what is attached right now, buses and devices in the order of a tree walk
+//Every bus comes first and then its devices, each one after its parent hub, so level is enough to draw the tree
+//It fails with EAGAIN in the rare case that devices keep coming faster than a snapshot could be taken, just retry it
+#define USBLOG_TOPO_BUS		0x01	//A bus, only busnum is set
+#define USBLOG_TOPO_HUB		0x02	//A device of the hub class
+struct usblog_topo_entry{
+	__u16 busnum;
+	__u8 devnum;
+	__u8 parent;		//devnum of the parent hub, zero for a root hub
+	__u8 level;		//Number of hubs between the device and its bus
+	__u8 portnum;		//Port of the parent hub
+	__u8 flags;		//USBLOG_TOPO_* values
+	__u8 speed;		//enum usb_device_speed
+	__u16 vendor;
+	__u16 product;
+	__u8 dev_class;
+	__u8 reserved[3];
+	__u32 serial_hash;
+	__u32 intf_classes;
+	__u64 attached;		//CLOCK_BOOTTIME of the attach in nanoseconds, zero if it was there before the module
+	char devpath[USBLOG_DEVPATH_LEN];
+};
+struct usblog_topology{
+	__u64 entries;		//User pointer to an array of max struct usblog_topo_entry
+	__u32 max;		//Room in entries
+	__u32 count;		//Out: entries copied
+	__u32 total;		//Out: buses and devices attached
+	__u32 reserved;
+	__u64 generation;	//Out: increases on every change, so a poller could tell nothing has changed
+};
+
+//IOCTL_LOG_PERF returns the cost of the logger's own hot paths, every CPU keeps its own copy and they are summed on read
+//Bucket i of a histogram counts the calls which took [2^i, 2^(i+1)) nanoseconds, bucket 0 includes zero
+//and the last bucket everything longer, IOCTL_LOG_PERF_RESET starts them all from zero again
+enum usblog_perf_path{
+	USBLOG_PERF_NOTIFY,		//usb_notify from the notifier chain to the ring store
+	USBLOG_PERF_DEVICE_LOCK,	//Waiting for the lock of the per-device table in usb_notify
+	USBLOG_PERF_BLOCKLIST_LOCK,	//Waiting for the writers' mutex of the blocklist
+	USBLOG_PERF_WORK,		//One run of the log work, archive, kernel log, journal and netlink
+	USBLOG_PERF_PROC,		//One read() of /proc/usblogger
+	USBLOG_PERF_STREAM,		//One read() of /proc/usblogger_events, including the time it slept
+	USBLOG_PERF_DRAIN,		//IOCTL_LOG_DRAIN
+	USBLOG_PERF_QUERY,		//IOCTL_LOG_QUERY
+	USBLOG_PERF_NR,
+};
+#define USBLOG_PERF_BUCKETS	32
+struct usblog_perf_hist{
+	__u64 count;
+	__u64 sum;		//Total nanoseconds of all the calls
+	__u64 max;
+	__u64 buckets[USBLOG_PERF_BUCKETS];
+};
+struct usblog_perf_stats{
+	__u32 version;		//USBLOG_STATS_VERSION of the kernel that filled it
+	__u32 nr_paths;		//USBLOG_PERF_NR
+	__u32 nr_buckets;	//USBLOG_PERF_BUCKETS
+	__u32 reserved;
+	__u64 dropped;		//Notifications without a device
+	__u64 overruns;		//Records overwritten in the rings before the log work could archive them
+	__u64 untracked;	//Device events which did not fit in the per-device table
+	__u64 nl_dropped;	//Events that could not be multicast
+	struct usblog_perf_hist paths[USBLOG_PERF_NR];
+};
+
 //These are our ioctl definition
+//Every query returns a native int (or a structure), never a string
 #define LOG_MAGIC 'Q'
-#define LOG_IOC_MAXNR 8
+#define LOG_IOC_MAXNR 16
 #define IOCTL_LOG_RESET 	_IO(LOG_MAGIC, 0)
 #define IOCTL_LOG_COUNT 	_IOR(LOG_MAGIC, 1, int)
 #define IOCTL_LOG_SPACE 	_IOR(LOG_MAGIC, 2, int)
@@ -9,10 +358,19 @@
 #define IOCTL_LOG_EMPTY 	_IOR(LOG_MAGIC, 5, int)
 #define IOCTL_LOG_ESIZE 	_IOR(LOG_MAGIC, 6, int)
 #define IOCTL_LOG_DELETE 	_IOW(LOG_MAGIC, 7, int)
+#define IOCTL_LOG_STATS 	_IOR(LOG_MAGIC, 8, struct usblog_log_stats)
+#define IOCTL_LOG_DRAIN 	_IOWR(LOG_MAGIC, 9, struct usblog_drain)
+#define IOCTL_LOG_RETAIN 	_IOW(LOG_MAGIC, 10, __u64)
+#define IOCTL_LOG_QUERY 	_IOWR(LOG_MAGIC, 11, struct usblog_query)
+#define IOCTL_LOG_DEVICES 	_IOWR(LOG_MAGIC, 12, struct usblog_device_list)
+//13 was the self-test, tools/usblogreplay benchmarks the capture path and tools/usblogtest tests it now
+#define IOCTL_LOG_PERF 		_IOR(LOG_MAGIC, 14, struct usblog_perf_stats)
+#define IOCTL_LOG_PERF_RESET 	_IO(LOG_MAGIC, 15)
+#define IOCTL_LOG_TOPOLOGY 	_IOWR(LOG_MAGIC, 16, struct usblog_topology)
 
 
 #define DEV_MAGIC 'T'
-#define DEV_IOC_MAXNR 7
+#define DEV_IOC_MAXNR 9
 #define IOCTL_DEV_RESET 	_IO(DEV_MAGIC, 0)
 #define IOCTL_DEV_COUNT 	_IOR(DEV_MAGIC, 1, int)
 #define IOCTL_DEV_SPACE 	_IOR(DEV_MAGIC, 2, int)
@@ -20,4 +378,8 @@
 #define IOCTL_DEV_FULL 		_IOR(DEV_MAGIC, 4, int)
 #define IOCTL_DEV_EMPTY 	_IOR(DEV_MAGIC, 5, int)
 #define IOCTL_DEV_ESIZE 	_IOR(DEV_MAGIC, 6, int)
+#define IOCTL_DEV_HITS 		_IOWR(DEV_MAGIC, 7, struct usblog_rule_hits)
+#define IOCTL_DEV_STATS 	_IOR(DEV_MAGIC, 8, struct usblog_dev_stats)
+#define IOCTL_DEV_LOAD 		_IOWR(DEV_MAGIC, 9, struct usblog_rule_batch)
 
+#endif
@@ -0,0 +1,456 @@
+//Stress tool which replays USB events through the storage core of the module in userspace
+//Every writer thread plays one CPU and calls the same code as usb_notify: a blocklist lookup and a ring store
+//Reader threads follow the rings like stream readers meanwhile, then throughput and latency percentiles are printed
+//At the end what is left in the rings (and the trace) is packed the way the archive does it, to see the bytes per event
+//This is the benchmark of the capture path, a small ring_size makes the rings go around under the readers
+//Usage: usblogreplay [-t threads] [-R readers] [-n events] [-r ring_size] [-b rules] [-f trace]
+//The trace is either a journal file of the module or a plain array of records, without it the events are synthetic
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "usbloggercore.h"
+
+#define BATCH_LEN 64
+#define MAX_THREADS 256
+#define MAX_READERS 64
+#define LINE_LEN 128
+
+
+struct replay{
+	unsigned int threads;
+	unsigned int events;
+	const struct usblog_record *trace;
+	size_t trace_len;
+	volatile int go;
+	volatile int writers_left;
+	//events latencies for each writer
+	u64 *latencies;
+	u64 matched;
+};
+
+struct replay_writer{
+	struct replay *ctx;
+	unsigned int slot;
+	pthread_t thread;
+};
+
+//Every reader follows the rings on its own, like every open file of /proc/usblogstream does
+struct replay_reader{
+	struct replay *ctx;
+	pthread_t thread;
+	u64 read, lost, misordered;
+};
+
+
+static u64 now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//The notifier of the module without a struct usb_device: match, count and store
+static void replay_capture(struct usblog_record *event){
+	struct usblog_rule *rule;
+
+	if(event->action == USBLOG_ACTION_DEVICE_ADD){
+		rcu_read_lock();
+		rule = blocklist_match(event, NULL);
+		if(rule){
+			this_cpu_inc(*rule->hits);
+			event->flags |= USBLOG_FLAG_BLOCKED;
+		}
+		rcu_read_unlock();
+	}
+	log_ring_store(event);
+}
+
+
+//Make up an event, the ids repeat over a small range so rules like "1000:2000" have something to match
+static void replay_synthetic(struct usblog_record *event, unsigned int slot, unsigned int i){
+	memset(event, 0, sizeof(*event));
+	event->action = (i & 1) ? USBLOG_ACTION_DEVICE_REMOVE : USBLOG_ACTION_DEVICE_ADD;
+	event->vendor = 0x1000 + (i >> 1) % 251;
+	event->product = 0x2000 + (i >> 1) % 241;
+	event->dev_class = USB_CLASS_MASS_STORAGE;
+	event->busnum = 1 + slot % 8;
+	event->devnum = 1 + (i >> 1) % 127;
+	snprintf(event->devpath, sizeof(event->devpath), "%u.%u", 1 + slot % 4, 1 + (i >> 1) % 4);
+}
+
+
+static void *replay_writer_fn(void *data){
+	struct replay_writer *writer = data;
+	struct replay *ctx = writer->ctx;
+	u64 *latency = ctx->latencies + (size_t) writer->slot * ctx->events;
+	struct usblog_record event;
+	unsigned int i;
+	u64 start, matched = 0;
+
+	//This thread is the CPU slot, so it is the only writer of its ring
+	usblog_shim_cpu = writer->slot;
+	while(!__atomic_load_n(&ctx->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	for(i=0; i<ctx->events; i++){
+		if(ctx->trace_len){
+			event = ctx->trace[((size_t) writer->slot * ctx->events + i) % ctx->trace_len];
+			event.flags &= ~(USBLOG_FLAG_BLOCKED | USBLOG_FLAG_REJECTED);
+		}
+		else
+			replay_synthetic(&event, writer->slot, i);
+		start = now_ns();
+		event.timestamp = start;
+		replay_capture(&event);
+		latency[i] = now_ns() - start;
+		matched += !!(event.flags & USBLOG_FLAG_BLOCKED);
+	}
+	__atomic_add_fetch(&ctx->matched, matched, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&ctx->writers_left, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+//Follow the rings while the writers are running, and check the order of what we get
+static void *replay_reader_fn(void *data){
+	struct replay_reader *reader = data;
+	struct replay *ctx = reader->ctx;
+	struct usblog_record batch[BATCH_LEN];
+	u64 cursor = 1, last_seq;
+	int i, count, stop;
+
+	while(!__atomic_load_n(&ctx->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	do{
+		//One more pass after the writers are done, so it sees their last records
+		stop = !__atomic_load_n(&ctx->writers_left, __ATOMIC_ACQUIRE);
+		last_seq = log_ring_stable_seq();
+		while((count = log_ring_collect(cursor, last_seq, batch, BATCH_LEN)) > 0){
+			for(i=0; i<count; i++){
+				if(batch[i].seq < cursor){
+					reader->misordered++;
+					continue;
+				}
+				reader->lost += batch[i].seq - cursor;
+				cursor = batch[i].seq + 1;
+				reader->read++;
+			}
+			if(count < BATCH_LEN)
+				break;
+		}
+		if(count >= 0 && last_seq >= cursor){
+			reader->lost += last_seq + 1 - cursor;
+			cursor = last_seq + 1;
+		}
+	}while(!stop);
+	return NULL;
+}
+
+
+//Load the rules, one per line in the same format as /proc/blockedusb takes them
+//They are sent to the core as one batch, like a binary write to /proc/blockedusb does
+static int replay_load_rules(const char *path){
+	struct usblog_rule_batch *batch, *bigger;
+	char line[LINE_LEN];
+	unsigned int lineno = 0, *linenos = NULL, *more, room = 0;
+	FILE *file;
+	int err = SUCCESS;
+
+	file = fopen(path, "r");
+	if(!file)
+		return -errno;
+	batch = calloc(1, sizeof(*batch));
+	if(!batch){
+		fclose(file);
+		return -ENOMEM;
+	}
+	while(!err && fgets(line, sizeof(line), file)){
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if(!line[0] || line[0] == '#')
+			continue;
+		if(batch->count == room){
+			room = room ? room * 2 : 64;
+			bigger = realloc(batch, sizeof(*batch) + room * sizeof(struct usblog_rule_spec));
+			if(bigger)
+				batch = bigger;
+			more = realloc(linenos, room * sizeof(*linenos));
+			if(more)
+				linenos = more;
+			if(!bigger || !more){
+				err = -ENOMEM;
+				break;
+			}
+		}
+		linenos[batch->count] = lineno;
+		err = blocklist_parse_rule(line, &batch->rules[batch->count++]);
+		if(err)
+			fprintf(stderr, "usblogreplay: %s:%u: %s\n", path, lineno, strerror(-err));
+	}
+	fclose(file);
+
+	if(!err){
+		batch->magic = USBLOG_BATCH_MAGIC;
+		batch->version = USBLOG_BATCH_VERSION;
+		err = blocklist_load(batch);
+		if(err && batch->error_index < batch->count)
+			fprintf(stderr, "usblogreplay: %s:%u: %s\n", path, linenos[batch->error_index], strerror(-err));
+	}
+	free(linenos);
+	free(batch);
+	return err;
+}
+
+
+//Load a trace, a journal file is detected by the magic of its first segment
+static int replay_load_trace(const char *path, struct usblog_record **trace, size_t *len){
+	struct usblog_journal_segment *segment;
+	char *buf;
+	long size;
+	size_t off, count = 0;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if(!file)
+		return -errno;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	buf = size > 0 ? malloc(size) : NULL;
+	if(!buf || fread(buf, 1, size, file) != (size_t) size){
+		free(buf);
+		fclose(file);
+		return size > 0 ? -EIO : -EINVAL;
+	}
+	fclose(file);
+
+	segment = (struct usblog_journal_segment *) buf;
+	if(size >= USBLOG_JOURNAL_SEGMENT_SIZE && segment->magic == USBLOG_JOURNAL_MAGIC){
+		//Pack the records of the valid segments to the front of the buffer
+		for(off=0; off + USBLOG_JOURNAL_SEGMENT_SIZE <= (size_t) size; off += USBLOG_JOURNAL_SEGMENT_SIZE){
+			segment = (struct usblog_journal_segment *) (buf + off);
+			if(segment->magic != USBLOG_JOURNAL_MAGIC || segment->version != USBLOG_JOURNAL_VERSION
+				|| segment->count > USBLOG_JOURNAL_RECORDS)
+				continue;
+			memmove(buf + count * sizeof(struct usblog_record), segment->records, segment->count * sizeof(struct usblog_record));
+			count += segment->count;
+		}
+	}
+	else
+		count = size / sizeof(struct usblog_record);
+
+	if(!count){
+		free(buf);
+		return -EINVAL;
+	}
+	*trace = (struct usblog_record *) buf;
+	*len = count;
+	return SUCCESS;
+}
+
+
+static int replay_cmp(const void *a, const void *b){
+	u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static u64 replay_percentile(const u64 *sorted, size_t n, unsigned int per_mille){
+	return sorted[min_t(size_t, n - 1, n * per_mille / 1000)];
+}
+
+
+//Pack records into page sized blocks like the archive of the module, then decode every block and compare
+static void replay_pack(const struct usblog_record *records, size_t count, const char *what){
+	struct usblog_packer packer;
+	struct usblog_record *decoded;
+	u8 *block;
+	size_t first, i = 0, n, len, pos, bytes = 0, pages = 0, bad = 0;
+	u64 start, pack_ns = 0, unpack_ns = 0;
+
+	//Even the smallest record takes two bytes
+	block = malloc(PAGE_SIZE);
+	decoded = malloc(PAGE_SIZE / 2 * sizeof(*decoded));
+	if(!block || !decoded || !count){
+		free(block);
+		free(decoded);
+		return;
+	}
+	while(i < count){
+		start = now_ns();
+		log_pack_init(&packer);
+		len = 0;
+		for(first=i; i<count && log_pack_record(&packer, &records[i], block, &len, PAGE_SIZE); i++)
+			;
+		pack_ns += now_ns() - start;
+		bytes += len;
+		pages++;
+
+		start = now_ns();
+		log_pack_init(&packer);
+		pos = 0;
+		for(n=0; n<i-first && log_unpack_record(&packer, block, len, &pos, &decoded[n]); n++)
+			;
+		unpack_ns += now_ns() - start;
+		bad += i - first - n;
+		while(n--)
+			bad += !!memcmp(&decoded[n], &records[first + n], sizeof(*decoded));
+	}
+	printf("packed %s: %zu events in %zu pages, %.2f bytes/event (%zu raw), %.0f events/page, %zu mismatched\n",
+		what, count, pages, (double) bytes / count, sizeof(struct usblog_record), (double) count / pages, bad);
+	printf("packed %s: %.1f ns/event to pack, %.1f ns/event to decode\n", what, (double) pack_ns / count,
+		(double) unpack_ns / count);
+	free(block);
+	free(decoded);
+}
+
+
+//Everything which is still in the rings after the run, in sequence order
+static void replay_pack_rings(void){
+	struct usblog_record *records;
+	unsigned long room = log_ring_capacity();
+	u64 cursor = 1, last_seq = log_ring_stable_seq();
+	size_t count = 0;
+	int n;
+
+	records = malloc(room * sizeof(*records));
+	if(!records)
+		return;
+	while(count < room && (n = log_ring_collect(cursor, last_seq, records + count, min_t(unsigned long, room - count, 1 << 20))) > 0){
+		count += n;
+		cursor = records[count - 1].seq + 1;
+	}
+	replay_pack(records, count, "rings");
+	free(records);
+}
+
+
+static void usage(void){
+	fprintf(stderr, "Usage: usblogreplay [-t threads] [-R readers] [-n events] [-r ring_size] [-b rules] [-f trace]\n");
+	exit(2);
+}
+
+
+int main(int argc, char *argv[]){
+	struct replay ctx = { .threads = 4, .events = 100000 };
+	struct replay_writer writers[MAX_THREADS];
+	struct replay_reader readers[MAX_READERS] = {{0}};
+	struct usblog_record *trace = NULL;
+	const char *rules = NULL, *trace_path = NULL;
+	unsigned int size = 4096, nr_readers = 1, i;
+	u64 read = 0, lost = 0, misordered = 0, least_read = ~0ULL;
+	size_t samples;
+	u64 start, duration;
+	void *area;
+	int opt, err;
+
+	while((opt = getopt(argc, argv, "t:R:n:r:b:f:")) != -1){
+		switch(opt){
+			case 't':
+				ctx.threads = strtoul(optarg, NULL, 0);
+				break;
+			case 'R':
+				nr_readers = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				ctx.events = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				size = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				rules = optarg;
+				break;
+			case 'f':
+				trace_path = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if(optind != argc || !ctx.threads || ctx.threads > MAX_THREADS || nr_readers > MAX_READERS || !ctx.events || size < 2 || size > (1U << 20))
+		usage();
+	//Same rounding as the ring_size parameter of the module
+	while(size & (size - 1))
+		size += size & -size;
+
+	//The rings, one for each writer thread
+	usblog_shim_nr_cpus = ctx.threads;
+	area = calloc(1, log_ring_area_size(size, ctx.threads));
+	blocklist = blocklist_alloc();
+	samples = (size_t) ctx.threads * ctx.events;
+	ctx.latencies = calloc(samples, sizeof(*ctx.latencies));
+	if(!area || !blocklist || !ctx.latencies){
+		fprintf(stderr, "usblogreplay: out of memory\n");
+		return 1;
+	}
+	log_ring_setup(area, size, ctx.threads);
+
+	if(rules && (err = replay_load_rules(rules))){
+		fprintf(stderr, "usblogreplay: cannot load %s: %s\n", rules, strerror(-err));
+		return 1;
+	}
+	if(trace_path){
+		err = replay_load_trace(trace_path, &trace, &ctx.trace_len);
+		if(err){
+			fprintf(stderr, "usblogreplay: cannot load %s: %s\n", trace_path, strerror(-err));
+			return 1;
+		}
+		ctx.trace = trace;
+	}
+
+	ctx.writers_left = ctx.threads;
+	for(i=0; i<nr_readers; i++){
+		readers[i].ctx = &ctx;
+		pthread_create(&readers[i].thread, NULL, replay_reader_fn, &readers[i]);
+	}
+	for(i=0; i<ctx.threads; i++){
+		writers[i].ctx = &ctx;
+		writers[i].slot = i;
+		pthread_create(&writers[i].thread, NULL, replay_writer_fn, &writers[i]);
+	}
+	start = now_ns();
+	__atomic_store_n(&ctx.go, 1, __ATOMIC_RELEASE);
+	for(i=0; i<ctx.threads; i++)
+		pthread_join(writers[i].thread, NULL);
+	duration = now_ns() - start;
+	for(i=0; i<nr_readers; i++){
+		pthread_join(readers[i].thread, NULL);
+		read += readers[i].read;
+		lost += readers[i].lost;
+		misordered += readers[i].misordered;
+		least_read = min(least_read, readers[i].read);
+	}
+
+	qsort(ctx.latencies, samples, sizeof(*ctx.latencies), replay_cmp);
+	printf("events: %zu on %u threads, %u records per ring, %u rules, %s\n", samples, ctx.threads, size, blocklist_count(),
+		trace_path ? trace_path : "synthetic");
+	printf("throughput: %.0f events/s in %.3f ms\n", samples * 1e9 / (duration ? duration : 1), duration / 1e6);
+	printf("latency ns: p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+		(unsigned long long) replay_percentile(ctx.latencies, samples, 500),
+		(unsigned long long) replay_percentile(ctx.latencies, samples, 900),
+		(unsigned long long) replay_percentile(ctx.latencies, samples, 990),
+		(unsigned long long) replay_percentile(ctx.latencies, samples, 999),
+		(unsigned long long) ctx.latencies[samples - 1]);
+	printf("matched: %llu\n", (unsigned long long) ctx.matched);
+	//Every reader should account for every event, either read or lost to wraparound
+	if(nr_readers)
+		printf("readers: %u, %llu read %llu lost %llu misordered in total, the slowest read %llu\n", nr_readers,
+			(unsigned long long) read, (unsigned long long) lost, (unsigned long long) misordered,
+			(unsigned long long) least_read);
+	replay_pack_rings();
+	if(trace)
+		replay_pack(trace, ctx.trace_len, "trace");
+
+	blocklist_free(blocklist);
+	free(ctx.latencies);
+	free(trace);
+	free(area);
+	return 0;
+}
@@ -0,0 +1,152 @@
+//Userspace side of the USB Logger shared memory rings, see usblogring.h
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "usblogring.h"
+
+
+//Read a 64-bit counter that the kernel keeps updating
+static __u64 load_u64(const __u64 *value){
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+
+//Same protocol as the kernel readers, copy the slot and check its sequence did not change
+static int read_slot(const struct usblog_ring_reader *reader, __u32 ring, __u64 pos, struct usblog_record *out){
+	const struct usblog_record *slot = &reader->records[(size_t) ring * reader->header->ring_size + (pos & (reader->header->ring_size - 1))];
+	__u64 seq = load_u64(&slot->seq);
+
+	memcpy(out, slot, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return seq != 0 && out->seq == seq && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+
+//Wait for the writers that took a sequence number before we looked at head_seq
+static __u64 stable_seq(const struct usblog_ring_reader *reader){
+	const struct usblog_ring_header *header = reader->header;
+	__u64 seq = __atomic_load_n(&header->head_seq, __ATOMIC_SEQ_CST);
+	__u64 head;
+	__u32 i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(i=0; i<header->nr_rings; i++){
+		head = load_u64(&header->heads[i].head);
+		while(load_u64(&header->heads[i].busy) && load_u64(&header->heads[i].head) == head)
+			;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return seq;
+}
+
+
+int usblog_ring_open(struct usblog_ring_reader *reader, const char *path, int from_start){
+	struct usblog_ring_header first;
+	void *map;
+	__u32 i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = open(path, O_RDONLY);
+	if(reader->fd < 0)
+		return -errno;
+
+	//First map only the fixed part of the header to learn the geometry of the rings
+	map = mmap(NULL, sizeof(first), PROT_READ, MAP_SHARED, reader->fd, 0);
+	if(map == MAP_FAILED)
+		goto fail;
+	memcpy(&first, map, sizeof(first));
+	munmap(map, sizeof(first));
+	if(first.magic != USBLOG_RING_MAGIC || first.version != USBLOG_RING_VERSION || first.record_size != sizeof(struct usblog_record)){
+		errno = EPROTO;
+		goto fail;
+	}
+
+	reader->map_size = first.data_offset + (size_t) first.nr_rings * first.ring_size * first.record_size;
+	reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+	if(reader->map == MAP_FAILED){
+		reader->map = NULL;
+		goto fail;
+	}
+	reader->header = reader->map;
+	reader->records = (const struct usblog_record *) ((const char *) reader->map + first.data_offset);
+	reader->positions = calloc(first.nr_rings, sizeof(*reader->positions));
+	if(!reader->positions)
+		goto fail;
+
+	//Either start from the oldest record or right after the latest one
+	if(from_start){
+		reader->next_seq = 1;
+	}
+	else{
+		reader->next_seq = stable_seq(reader) + 1;
+		for(i=0; i<first.nr_rings; i++)
+			reader->positions[i] = load_u64(&reader->header->heads[i].head);
+	}
+	return 0;
+
+fail:
+	i = errno;
+	usblog_ring_close(reader);
+	return -(int) i;
+}
+
+
+void usblog_ring_close(struct usblog_ring_reader *reader){
+	if(reader->map)
+		munmap(reader->map, reader->map_size);
+	if(reader->fd >= 0)
+		close(reader->fd);
+	free(reader->positions);
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+}
+
+
+size_t usblog_ring_read(struct usblog_ring_reader *reader, struct usblog_record *out, size_t max){
+	const struct usblog_ring_header *header = reader->header;
+	struct usblog_record rec, best_rec;
+	__u64 last_seq, head, tail, tail_seq;
+	size_t count = 0;
+	__u32 i;
+	int best;
+
+	last_seq = stable_seq(reader);
+	//Records before tail_seq have been discarded by a reset
+	tail_seq = load_u64(&header->tail_seq);
+	if(reader->next_seq < tail_seq)
+		reader->next_seq = tail_seq;
+
+	while(count < max){
+		best = -1;
+		for(i=0; i<header->nr_rings; i++){
+			head = load_u64(&header->heads[i].head);
+			tail = head > header->ring_size ? head - header->ring_size : 0;
+			if(reader->positions[i] < tail)
+				reader->positions[i] = tail;
+			//Skip what we already returned or what was being rewritten
+			while(reader->positions[i] < head){
+				if(read_slot(reader, i, reader->positions[i], &rec) && rec.seq >= reader->next_seq)
+					break;
+				reader->positions[i]++;
+			}
+			if(reader->positions[i] >= head || rec.seq > last_seq)
+				continue;
+			if(best < 0 || rec.seq < best_rec.seq){
+				best = i;
+				best_rec = rec;
+			}
+		}
+		if(best < 0)
+			break;
+		//A gap in the sequence means the kernel overwrote records before we got to them
+		reader->lost += best_rec.seq - reader->next_seq;
+		reader->next_seq = best_rec.seq + 1;
+		reader->positions[best]++;
+		out[count++] = best_rec;
+	}
+	return count;
+}
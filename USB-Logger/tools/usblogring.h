@@ -0,0 +1,28 @@
+//A tiny userspace library for tailing the USB Logger event rings through mmap
+//It maps /proc/usblogger read-only and merges the per-CPU rings by sequence number
+//without any system call or copy from the kernel
+#ifndef USBLOGRING_H
+#define USBLOGRING_H
+
+#include <stddef.h>
+#include "../commonioctlcommands.h"
+
+struct usblog_ring_reader{
+	int fd;
+	void *map;
+	size_t map_size;
+	const struct usblog_ring_header *header;
+	const struct usblog_record *records;
+	__u64 *positions;	//Next position to look at on each ring
+	__u64 next_seq;		//Next sequence number we are going to return
+	__u64 lost;		//Records that were overwritten before we could read them
+};
+
+//Map the rings, from_start selects whether we begin at the oldest record or only wait for new ones
+int usblog_ring_open(struct usblog_ring_reader *reader, const char *path, int from_start);
+void usblog_ring_close(struct usblog_ring_reader *reader);
+
+//Copy up to max records in sequence order, returns how many were copied (zero if nothing is new)
+size_t usblog_ring_read(struct usblog_ring_reader *reader, struct usblog_record *out, size_t max);
+
+#endif
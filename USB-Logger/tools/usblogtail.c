@@ -0,0 +1,68 @@
+//Sample tool which follows the USB Logger rings through mmap, like tail -f
+//Usage: usblogtail [-a] [path], -a prints the records that are already in the rings too
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usblogring.h"
+
+#define BATCH_LEN 64
+#define IDLE_SLEEP_NS 100000000L
+
+
+static const char *action_name(__u8 action){
+	switch(action){
+		case USBLOG_ACTION_DEVICE_ADD:
+			return "DA";
+		case USBLOG_ACTION_DEVICE_REMOVE:
+			return "DR";
+		case USBLOG_ACTION_BUS_ADD:
+			return "BA";
+		case USBLOG_ACTION_BUS_REMOVE:
+			return "BR";
+		default:
+			return "??";
+	}
+}
+
+
+int main(int argc, char *argv[]){
+	struct usblog_ring_reader reader;
+	struct usblog_record batch[BATCH_LEN];
+	struct timespec idle = {0, IDLE_SLEEP_NS};
+	const char *path = "/proc/usblogger";
+	int from_start = 0, i, err;
+	size_t count, n;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "-a"))
+			from_start = 1;
+		else
+			path = argv[i];
+	}
+
+	err = usblog_ring_open(&reader, path, from_start);
+	if(err){
+		fprintf(stderr, "usblogtail: cannot map %s: %s\n", path, strerror(-err));
+		return 1;
+	}
+
+	for(;;){
+		count = usblog_ring_read(&reader, batch, BATCH_LEN);
+		for(n=0; n<count; n++)
+			printf("%llu: %04X:%04X %s %02X %u-%.*s [%llu.%09llu]\n", (unsigned long long) batch[n].seq, batch[n].vendor,
+				batch[n].product, action_name(batch[n].action), batch[n].dev_class, batch[n].busnum,
+				(int) sizeof(batch[n].devpath), batch[n].devpath,
+				(unsigned long long) batch[n].timestamp / 1000000000ULL, (unsigned long long) batch[n].timestamp % 1000000000ULL);
+		if(count){
+			fflush(stdout);
+			continue;
+		}
+		//Nothing new, the rings are only memory so we just have a nap before looking again
+		nanosleep(&idle, NULL);
+	}
+
+	usblog_ring_close(&reader);
+	return 0;
+}
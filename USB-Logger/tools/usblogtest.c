@@ -0,0 +1,498 @@
+//Tests of the storage core of the module, built in userspace against libusblogcore.a
+//Every test sets up rings of its own, so nothing here could ever see or change the log of a loaded module
+//Threads play the CPUs like in usblogreplay, each one is the only writer of its ring
+//Usage: usblogtest, it prints one line for each test and exits with 1 if any check failed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usbloggercore.h"
+
+#define TEST_MAX_RECORDS 4096
+#define TEST_WRITERS 4
+#define TEST_READERS 2
+#define TEST_EVENTS 50000
+
+
+static unsigned int test_failed;
+
+#define CHECK(cond) test_check(!!(cond), #cond, __LINE__)
+
+static void test_check(int ok, const char *what, int line){
+	if(ok)
+		return;
+	test_failed++;
+	fprintf(stderr, "usblogtest.c:%d: check failed: %s\n", line, what);
+}
+
+
+//Rings of size records for nr CPUs, the caller frees the area
+static void *test_rings(unsigned int size, unsigned int nr){
+	void *area;
+
+	usblog_shim_nr_cpus = nr;
+	usblog_shim_cpu = 0;
+	area = calloc(1, log_ring_area_size(size, nr));
+	if(!area){
+		fprintf(stderr, "usblogtest: out of memory\n");
+		exit(2);
+	}
+	log_ring_setup(area, size, nr);
+	return area;
+}
+
+
+static void test_event(struct usblog_record *event, u8 action, u16 vendor, u16 product, u8 dev_class){
+	memset(event, 0, sizeof(*event));
+	event->action = action;
+	event->vendor = vendor;
+	event->product = product;
+	event->dev_class = dev_class;
+	event->busnum = 1;
+	snprintf(event->devpath, sizeof(event->devpath), "1.%u", product & 7);
+}
+
+
+//The notifier of the module without a struct usb_device: match, count and store
+static void test_capture(struct usblog_record *event, const char *serial){
+	struct usblog_rule *rule;
+
+	if(event->action == USBLOG_ACTION_DEVICE_ADD){
+		rcu_read_lock();
+		rule = blocklist_match(event, serial);
+		if(rule){
+			this_cpu_inc(*rule->hits);
+			event->flags |= USBLOG_FLAG_BLOCKED;
+		}
+		rcu_read_unlock();
+	}
+	log_ring_store(event);
+}
+
+
+static int test_collect(u64 from_seq, struct usblog_record *out){
+	return log_ring_collect(from_seq, log_ring_stable_seq(), out, TEST_MAX_RECORDS);
+}
+
+
+//Records come out in the order they were stored, with gapless sequence numbers, even spread over several rings
+static void test_order(struct usblog_record *records){
+	void *area = test_rings(16, 3);
+	struct usblog_record event;
+	int i, count;
+
+	for(i=0; i<30; i++){
+		usblog_shim_cpu = (i * 7) % 3;
+		test_event(&event, (i & 1) ? USBLOG_ACTION_DEVICE_REMOVE : USBLOG_ACTION_DEVICE_ADD, 0x1000, i, USB_CLASS_HID);
+		event.timestamp = 1000 + i;
+		test_capture(&event, NULL);
+		CHECK(event.seq == (u64) i + 1);
+	}
+	CHECK(log_ring_stable_seq() == 30);
+	CHECK(log_ring_count(1) == 30);
+	count = test_collect(1, records);
+	CHECK(count == 30);
+	for(i=0; i<count; i++){
+		CHECK(records[i].seq == (u64) i + 1);
+		CHECK(records[i].product == i);
+		CHECK(records[i].timestamp == (u64) 1000 + i);
+	}
+	//A reader in the middle only gets what is after its cursor
+	CHECK(test_collect(26, records) == 5);
+	CHECK(records[0].seq == 26);
+	CHECK(test_collect(31, records) == 0);
+	free(area);
+}
+
+
+//A ring keeps only its newest records, readers see the overwritten ones as a gap of exactly that many
+static void test_wraparound(struct usblog_record *records){
+	void *area = test_rings(8, 2);
+	struct usblog_record event;
+	unsigned int events = 28, i;
+	u64 cursor = 1, lost = 0;
+	int count;
+
+	for(i=0; i<events; i++){
+		test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x1000, i, USB_CLASS_HID);
+		test_capture(&event, NULL);
+	}
+	CHECK(log_ring_stable_seq() == events);
+	CHECK(log_ring_count(1) == 8);
+	CHECK(log_ring_capacity() == 16);
+	CHECK(log_ring_oldest_seq() == events - 8 + 1);
+
+	//Count the lost records the way a stream reader does, from the gaps in the sequence numbers
+	count = test_collect(cursor, records);
+	CHECK(count == 8);
+	for(i=0; i<(unsigned int) count; i++){
+		CHECK(records[i].seq >= cursor);
+		lost += records[i].seq - cursor;
+		cursor = records[i].seq + 1;
+	}
+	CHECK(lost == events - 8);
+	CHECK(cursor == events + 1);
+
+	//The other ring keeps its own records, however often the first one went around
+	usblog_shim_cpu = 1;
+	test_event(&event, USBLOG_ACTION_DEVICE_REMOVE, 0x1000, 99, USB_CLASS_HID);
+	test_capture(&event, NULL);
+	CHECK(test_collect(events - 1, records) == 3);
+	CHECK(records[2].product == 99);
+	CHECK(log_ring_oldest_seq() == events - 8 + 1);
+	free(area);
+}
+
+
+//Only the devices of a rule are marked, and every rule counts its own hits
+static void test_blocklist(struct usblog_record *records){
+	static const char *rules[] = { "0781:5567", "0781:5568 08", "0781:5569 * 4C530001" };
+	struct usblog_rule_spec spec;
+	void *area = test_rings(64, 1);
+	struct usblog_record event;
+	unsigned int i;
+	u64 hits;
+	int count;
+
+	mutex_lock(&blocklist_mutex);
+	for(i=0; i<ARRAY_SIZE(rules); i++){
+		CHECK(blocklist_parse_rule(rules[i], &spec) == SUCCESS);
+		CHECK(blocklist_add(&spec) == SUCCESS);
+	}
+	mutex_unlock(&blocklist_mutex);
+	CHECK(blocklist_parse_rule("0781", &spec) == -EINVAL);
+	CHECK(blocklist_parse_rule("0781:5567 zz", &spec) == -EINVAL);
+
+	test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5567, USB_CLASS_HID);
+	test_capture(&event, NULL);
+	test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5568, USB_CLASS_HID);
+	test_capture(&event, NULL);
+	test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5568, USB_CLASS_MASS_STORAGE);
+	test_capture(&event, NULL);
+	test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5569, USB_CLASS_MASS_STORAGE);
+	test_capture(&event, "OTHER");
+	test_event(&event, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5569, USB_CLASS_MASS_STORAGE);
+	test_capture(&event, "4C530001");
+	//Removes are never matched
+	test_event(&event, USBLOG_ACTION_DEVICE_REMOVE, 0x0781, 0x5567, USB_CLASS_HID);
+	test_capture(&event, NULL);
+
+	count = test_collect(1, records);
+	CHECK(count == 6);
+	CHECK(records[0].flags == USBLOG_FLAG_BLOCKED);
+	CHECK(records[1].flags == 0);
+	CHECK(records[2].flags == USBLOG_FLAG_BLOCKED);
+	CHECK(records[3].flags == 0);
+	CHECK(records[4].flags == USBLOG_FLAG_BLOCKED);
+	CHECK(records[5].flags == 0);
+	for(i=0; i<ARRAY_SIZE(rules); i++){
+		blocklist_parse_rule(rules[i], &spec);
+		CHECK(blocklist_hits(&spec, &hits) == SUCCESS && hits == 1);
+	}
+
+	CHECK(blocklist_reset() == SUCCESS);
+	CHECK(blocklist_count() == 0);
+	free(area);
+}
+
+
+//A device of class 0 is of the classes of its interfaces, for the blocklist, the queries and the zone maps
+//Like a USB stick, which has bDeviceClass 0 and one mass-storage interface
+static void test_intf_class(struct usblog_record *records){
+	struct usblog_record stick, hid, other;
+	struct usblog_query query = {0};
+	struct usblog_rule_spec spec;
+	struct usblog_zone zone;
+	void *area;
+	u64 hits;
+
+	test_event(&stick, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5567, USB_CLASS_PER_INTERFACE);
+	stick.intf_classes = BIT(USB_CLASS_MASS_STORAGE);
+	test_event(&hid, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5567, USB_CLASS_PER_INTERFACE);
+	hid.intf_classes = BIT(USB_CLASS_HID);
+	test_event(&other, USBLOG_ACTION_DEVICE_ADD, 0x0781, 0x5567, USB_CLASS_PER_INTERFACE);
+	other.intf_classes = BIT(USB_CLASS_AUDIO) | BIT(USBLOG_INTF_OTHER);
+	CHECK(log_record_has_class(&stick, USB_CLASS_MASS_STORAGE));
+	CHECK(log_record_has_class(&stick, USB_CLASS_PER_INTERFACE));
+	CHECK(!log_record_has_class(&stick, USB_CLASS_HID));
+	CHECK(log_record_has_class(&other, USB_CLASS_VENDOR_SPEC));
+	CHECK(!log_record_has_class(&other, USB_CLASS_MASS_STORAGE));
+	//Only a device of class 0 has its interfaces looked at
+	stick.dev_class = USB_CLASS_HUB;
+	CHECK(!log_record_has_class(&stick, USB_CLASS_MASS_STORAGE));
+	stick.dev_class = USB_CLASS_PER_INTERFACE;
+
+	//Mass-storage adds from vendor 0781
+	query.match = USBLOG_QUERY_VENDOR | USBLOG_QUERY_CLASS | USBLOG_QUERY_ACTION;
+	query.vendor = 0x0781;
+	query.dev_class = USB_CLASS_MASS_STORAGE;
+	query.action = USBLOG_ACTION_DEVICE_ADD;
+	CHECK(log_query_match(&query, &stick));
+	CHECK(!log_query_match(&query, &hid));
+	log_zone_init(&zone);
+	log_zone_add(&zone, &hid);
+	CHECK(!log_zone_match(&zone, &query));
+	log_zone_add(&zone, &stick);
+	CHECK(log_zone_match(&zone, &query));
+	query.dev_class = USB_CLASS_VENDOR_SPEC;
+	CHECK(!log_zone_match(&zone, &query));
+	log_zone_add(&zone, &other);
+	CHECK(log_zone_match(&zone, &query));
+
+	//A class rule blocks the stick, but not a device of the same ids with other interfaces
+	area = test_rings(16, 1);
+	mutex_lock(&blocklist_mutex);
+	CHECK(blocklist_parse_rule("0781:5567 08", &spec) == SUCCESS);
+	CHECK(blocklist_add(&spec) == SUCCESS);
+	mutex_unlock(&blocklist_mutex);
+	test_capture(&stick, NULL);
+	test_capture(&hid, NULL);
+	CHECK(test_collect(1, records) == 2);
+	CHECK(records[0].flags == USBLOG_FLAG_BLOCKED);
+	CHECK(records[1].flags == 0);
+	CHECK(blocklist_hits(&spec, &hits) == SUCCESS && hits == 1);
+	CHECK(blocklist_reset() == SUCCESS);
+	free(area);
+}
+
+
+#define TEST_SEC 1000000000LL
+
+//Replayed records of an earlier boot have negative boot times, queries and zone maps have to put them before this boot
+static void test_query(struct usblog_record *records){
+	//The earlier boot started two hours before this one
+	static const s64 boot_delta = -2 * 3600 * TEST_SEC;
+	struct usblog_query query = {0};
+	struct usblog_zone replayed, current, mixed;
+	unsigned int i, count;
+
+	for(i=0; i<6; i++){
+		test_event(&records[i], (i & 1) ? USBLOG_ACTION_DEVICE_REMOVE : USBLOG_ACTION_DEVICE_ADD, 0x0781,
+			0x5567, USB_CLASS_MASS_STORAGE);
+		records[i].timestamp = (u64) (i + 1) * 1800 * TEST_SEC;
+	}
+	//The first three come from the journal, the last of them is a storm
+	records[2].first_ts = records[2].timestamp - 60 * TEST_SEC;
+	records[2].repeats = 4;
+	records[2].flags = USBLOG_FLAG_FLAPPING;
+	for(i=0; i<3; i++)
+		log_replay_record(&records[i], boot_delta);
+	CHECK(records[0].flags == USBLOG_FLAG_REPLAYED);
+	CHECK(records[2].flags == (USBLOG_FLAG_FLAPPING | USBLOG_FLAG_REPLAYED));
+	CHECK((s64) records[0].timestamp == -5400 * TEST_SEC);
+	CHECK((s64) records[2].timestamp == -1800 * TEST_SEC);
+	CHECK((s64) records[2].first_ts == -1860 * TEST_SEC);
+
+	//Adds in the last hour, seen from 3 hours after this boot
+	query.match = USBLOG_QUERY_SINCE | USBLOG_QUERY_ACTION | USBLOG_QUERY_VENDOR | USBLOG_QUERY_CLASS;
+	query.since = 2 * 3600 * TEST_SEC;
+	query.action = USBLOG_ACTION_DEVICE_ADD;
+	query.vendor = 0x0781;
+	query.dev_class = USB_CLASS_MASS_STORAGE;
+	for(i=count=0; i<6; i++)
+		count += log_query_match(&query, &records[i]);
+	CHECK(count == 1);
+	CHECK(log_query_match(&query, &records[4]));
+
+	//Everything before this boot
+	memset(&query, 0, sizeof(query));
+	query.match = USBLOG_QUERY_UNTIL;
+	query.until = -1;
+	for(i=count=0; i<6; i++)
+		count += log_query_match(&query, &records[i]);
+	CHECK(count == 3);
+	//And the hour before it
+	query.match |= USBLOG_QUERY_SINCE;
+	query.since = -3600 * TEST_SEC;
+	CHECK(!log_query_match(&query, &records[0]));
+	CHECK(log_query_match(&query, &records[2]));
+
+	log_zone_init(&replayed);
+	log_zone_init(&current);
+	log_zone_init(&mixed);
+	for(i=0; i<6; i++){
+		log_zone_add(i < 3 ? &replayed : &current, &records[i]);
+		log_zone_add(&mixed, &records[i]);
+	}
+	CHECK(mixed.min_ts == -5400 * TEST_SEC);
+	CHECK(mixed.max_ts == 3 * 3600 * TEST_SEC);
+	//The hour before this boot, only the chunks with replayed records could have it
+	CHECK(log_zone_match(&replayed, &query));
+	CHECK(!log_zone_match(&current, &query));
+	CHECK(log_zone_match(&mixed, &query));
+	//The last hour of this boot
+	query.match = USBLOG_QUERY_SINCE;
+	query.since = 2 * 3600 * TEST_SEC;
+	CHECK(!log_zone_match(&replayed, &query));
+	CHECK(log_zone_match(&current, &query));
+	//The exact bitmaps and the bloom filters
+	query.match = USBLOG_QUERY_ACTION | USBLOG_QUERY_CLASS | USBLOG_QUERY_VENDOR | USBLOG_QUERY_PRODUCT;
+	query.action = USBLOG_ACTION_DEVICE_REMOVE;
+	query.dev_class = USB_CLASS_MASS_STORAGE;
+	query.vendor = 0x0781;
+	query.product = 0x5567;
+	CHECK(log_zone_match(&mixed, &query));
+	query.action = USBLOG_ACTION_BUS_ADD;
+	CHECK(!log_zone_match(&mixed, &query));
+	query.action = USBLOG_ACTION_DEVICE_REMOVE;
+	query.dev_class = USB_CLASS_HID;
+	CHECK(!log_zone_match(&mixed, &query));
+	//An empty zone has nothing in a time range
+	log_zone_init(&current);
+	query.match = USBLOG_QUERY_SINCE | USBLOG_QUERY_UNTIL;
+	query.since = -3600 * TEST_SEC;
+	query.until = 3600 * TEST_SEC;
+	CHECK(!log_zone_match(&current, &query));
+}
+
+
+struct test_concurrent{
+	volatile int go;
+	volatile int writers_left;
+	//What each reader has seen
+	u64 read[TEST_READERS], lost[TEST_READERS], bad[TEST_READERS];
+};
+
+struct test_thread{
+	struct test_concurrent *ctx;
+	unsigned int slot;
+	pthread_t thread;
+};
+
+
+//Every field of a record is derived from its writer and its number, so a torn copy is noticed
+static void test_concurrent_event(struct usblog_record *event, unsigned int writer, unsigned int i){
+	test_event(event, USBLOG_ACTION_DEVICE_ADD, (u16) (writer * 0x1111 + (i >> 16)), (u16) i, USB_CLASS_HID);
+	event->busnum = writer;
+	event->timestamp = (u64) writer << 32 | i;
+}
+
+
+static bool test_concurrent_check(const struct usblog_record *rec, u64 *next){
+	struct usblog_record expected;
+	unsigned int writer = rec->busnum, i = (u32) rec->timestamp;
+
+	if(writer >= TEST_WRITERS || i < next[writer])
+		return false;
+	next[writer] = i + 1;
+	test_concurrent_event(&expected, writer, i);
+	expected.seq = rec->seq;
+	return !memcmp(&expected, rec, sizeof(expected));
+}
+
+
+static void *test_writer_fn(void *data){
+	struct test_thread *self = data;
+	struct usblog_record event;
+	unsigned int i;
+
+	usblog_shim_cpu = self->slot;
+	while(!__atomic_load_n(&self->ctx->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	for(i=0; i<TEST_EVENTS; i++){
+		test_concurrent_event(&event, self->slot, i);
+		log_ring_store(&event);
+	}
+	__atomic_sub_fetch(&self->ctx->writers_left, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+//Follow the rings like a stream reader, every record has to be whole, newer than the last one and in writer order
+static void *test_reader_fn(void *data){
+	struct test_thread *self = data;
+	struct test_concurrent *ctx = self->ctx;
+	struct usblog_record batch[64];
+	u64 cursor = 1, last_seq, next[TEST_WRITERS] = {0};
+	int i, count, stop;
+
+	while(!__atomic_load_n(&ctx->go, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	do{
+		//One more pass after the writers are done, so it sees their last records
+		stop = !__atomic_load_n(&ctx->writers_left, __ATOMIC_ACQUIRE);
+		last_seq = log_ring_stable_seq();
+		while((count = log_ring_collect(cursor, last_seq, batch, ARRAY_SIZE(batch))) > 0){
+			for(i=0; i<count; i++){
+				if(batch[i].seq < cursor || !test_concurrent_check(&batch[i], next)){
+					ctx->bad[self->slot]++;
+					continue;
+				}
+				ctx->lost[self->slot] += batch[i].seq - cursor;
+				cursor = batch[i].seq + 1;
+				ctx->read[self->slot]++;
+			}
+		}
+		if(count < 0)
+			ctx->bad[self->slot]++;
+		if(last_seq >= cursor){
+			ctx->lost[self->slot] += last_seq + 1 - cursor;
+			cursor = last_seq + 1;
+		}
+	}while(!stop);
+	return NULL;
+}
+
+
+//Writers on every ring and readers at the same time, the rings are small so they go around all the time
+static void test_concurrent(struct usblog_record *records){
+	struct test_concurrent ctx = { .writers_left = TEST_WRITERS };
+	struct test_thread threads[TEST_WRITERS + TEST_READERS];
+	void *area = test_rings(256, TEST_WRITERS);
+	unsigned int i;
+
+	(void) records;
+	for(i=0; i<ARRAY_SIZE(threads); i++){
+		threads[i].ctx = &ctx;
+		threads[i].slot = i < TEST_WRITERS ? i : i - TEST_WRITERS;
+		pthread_create(&threads[i].thread, NULL, i < TEST_WRITERS ? test_writer_fn : test_reader_fn, &threads[i]);
+	}
+	__atomic_store_n(&ctx.go, 1, __ATOMIC_RELEASE);
+	for(i=0; i<ARRAY_SIZE(threads); i++)
+		pthread_join(threads[i].thread, NULL);
+
+	CHECK(log_ring_stable_seq() == (u64) TEST_WRITERS * TEST_EVENTS);
+	for(i=0; i<TEST_READERS; i++){
+		CHECK(ctx.bad[i] == 0);
+		CHECK(ctx.read[i] > 0);
+		CHECK(ctx.read[i] + ctx.lost[i] == (u64) TEST_WRITERS * TEST_EVENTS);
+	}
+	free(area);
+}
+
+
+static const struct{
+	const char *name;
+	void (*fn)(struct usblog_record *records);
+} tests[] = {
+	{ "order", test_order },
+	{ "wraparound", test_wraparound },
+	{ "blocklist", test_blocklist },
+	{ "query", test_query },
+	{ "intf_class", test_intf_class },
+	{ "concurrent", test_concurrent },
+};
+
+
+int main(void){
+	struct usblog_record *records = calloc(TEST_MAX_RECORDS, sizeof(*records));
+	unsigned int i, failed, total = 0;
+
+	blocklist = blocklist_alloc();
+	if(!records || !blocklist){
+		fprintf(stderr, "usblogtest: out of memory\n");
+		return 2;
+	}
+	for(i=0; i<ARRAY_SIZE(tests); i++){
+		failed = test_failed;
+		tests[i].fn(records);
+		printf("%s %s\n", test_failed == failed ? "ok  " : "FAIL", tests[i].name);
+		total += test_failed != failed;
+	}
+	printf("%u of %zu tests failed\n", total, ARRAY_SIZE(tests));
+
+	blocklist_free(blocklist);
+	free(records);
+	return total ? 1 : 0;
+}
@@ -0,0 +1,2849 @@
+//We need this header in almost all Kernel modules
+#include <linux/module.h>
+//Absolutely because we are doing Kernel job
+#include <linux/kernel.h>
+//And this is needed for the macros
+#include <linux/init.h>
+//For create and register a procfs entry
+#include <linux/proc_fs.h>
+//For providing read function of the entry with ease
+#include <linux/seq_file.h>
+//For ioctl commands and macros
+#include <linux/ioctl.h>
+#include <asm/ioctl.h>
+//For evaluating capabilities
+#include <linux/capability.h>
+//For using spinlocks
+#include <linux/spinlock.h>
+//For blocking I/O and waitqueues
+#include <linux/wait.h>
+//For poll and epoll on the event stream
+#include <linux/poll.h>
+//We want to play with USB devices
+#include <linux/usb.h>
+//For the per-device table and its per-CPU counters
+#include <linux/percpu.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+//For kcalloc and kfree
+#include <linux/slab.h>
+//For the shared memory area of the event rings
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+//For atomic64_t sequence counter
+#include <linux/atomic.h>
+//For rounding the ring capacity up to a power of two
+#include <linux/log2.h>
+//For "ktime_get_boot_ns" and "time64_to_tm" functions
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/time.h>
+//For the deferred work which formats and reports the new records in batches
+#include <linux/workqueue.h>
+//For the journal file and its checksums
+#include <linux/fs.h>
+#include <linux/crc32.h>
+#include <linux/sort.h>
+#include <linux/ratelimit.h>
+//For the cold tier of the log, which is a list of page chunks that could be compressed
+#include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/lzo.h>
+#include <linux/bitmap.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+//For the Generic Netlink family which pushes the events to any number of subscribers
+#include <net/genetlink.h>
+//For the histograms of our own hot paths in debugfs
+#include <linux/debugfs.h>
+//For obtaining PID and process name which demand some work from this module
+#include <linux/sched.h>
+//For raw_copy_to_user, raw_copy_from_user, put_user
+#include <asm/uaccess.h>
+
+#include "commonioctlcommands.h"
+//The rings, the blocklist and the formatting are in the storage core
+#include "usbloggercore.h"
+//The hooks for the KUnit suite, they are only built with make kunit
+#include "usbloggertest.h"
+//The tracepoints are created in this file
+#define CREATE_TRACE_POINTS
+#include "usbloggertrace.h"
+
+//This will be our module name
+#define MODULE_NAME "usblogger"
+//How many records we are going to merge from per-CPU rings in each step
+#define LOG_BATCH_LEN 64
+//The per-device table has 2^DEVICE_HASH_BITS buckets
+#define DEVICE_HASH_BITS 8
+//A storm which never calms down is still reported once in this many coalescing windows
+#define COALESCE_MAX_WINDOWS 64
+//The topology cache has 2^TOPO_HASH_BITS buckets
+#define TOPO_HASH_BITS 6
+//Room for the buses and devices which could be attached while a snapshot is taken
+#define TOPO_SLACK 16
+//A snapshot which still does not fit is given up after this many tries
+#define TOPO_SNAPSHOT_TRIES 3
+
+//These are some useful information that could reveald with modinfo command
+//Set module license to get rid of tainted kernel warnings
+MODULE_LICENSE("GPL");
+//Introduce the module's developer, it's functionality and version
+MODULE_AUTHOR("Aliireeza Teymoorian <teymoorian@gmail.com>");
+MODULE_DESCRIPTION("USB Logger, Record the USB ports activities on the system and block the unwanted devices");
+MODULE_VERSION("1.0.0");
+
+//Number of records each CPU keeps, it will be rounded up to a power of two
+static unsigned int ring_size = 32;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Number of USB event records kept per CPU (rounded up to a power of two)");
+
+//Maximum number of rules in the blocklist, it lives in the storage core
+module_param(blocklist_size, uint, 0444);
+MODULE_PARM_DESC(blocklist_size, "Maximum number of rules in the USB blocklist");
+
+//Whether blocked devices are deauthorized or only marked in the log
+static bool enforce_blocklist = true;
+module_param(enforce_blocklist, bool, 0644);
+MODULE_PARM_DESC(enforce_blocklist, "Deauthorize USB devices which match the blocklist (otherwise only log them)");
+
+//Whether new records are also written to the kernel log, and how many lines we allow in each interval
+static bool kernel_log = true;
+module_param(kernel_log, bool, 0644);
+MODULE_PARM_DESC(kernel_log, "Print the USB events to the kernel log too");
+static unsigned int kernel_log_burst = 10;
+module_param(kernel_log_burst, uint, 0444);
+MODULE_PARM_DESC(kernel_log_burst, "Maximum number of USB events printed to the kernel log in every 5 seconds");
+
+//The journal keeps the records in a file, so they survive reboots and module reloads
+static char *journal_path;
+module_param(journal_path, charp, 0444);
+MODULE_PARM_DESC(journal_path, "File for the persistent USB event journal (disabled if not set)");
+static unsigned int journal_segments = 64;
+module_param(journal_segments, uint, 0444);
+MODULE_PARM_DESC(journal_segments, "Number of 4KB segments in the journal file, the oldest one is reused when it is full");
+static unsigned int journal_flush_ms = 1000;
+module_param(journal_flush_ms, uint, 0644);
+MODULE_PARM_DESC(journal_flush_ms, "Delay before a partly filled journal segment is written out");
+
+//The cold tier keeps this many records after they leave the rings, it could be changed at any time
+//Packed records take about a tenth of their 64 bytes, so this is still only a few megabytes
+static unsigned long retention_events = 524288;
+static int retention_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops retention_ops = {
+	.set = retention_set,
+	.get = param_get_ulong,
+};
+module_param_cb(retention_events, &retention_ops, &retention_events, 0644);
+MODULE_PARM_DESC(retention_events, "Number of USB event records kept in memory after they leave the per-CPU rings");
+static bool compress_archive;
+module_param(compress_archive, bool, 0644);
+MODULE_PARM_DESC(compress_archive, "Compress the full chunks of the in-memory archive with LZO");
+
+//The per-device statistics table
+static unsigned int device_table_size = 4096;
+module_param(device_table_size, uint, 0444);
+MODULE_PARM_DESC(device_table_size, "Maximum number of USB devices in the per-device statistics table");
+static unsigned int flap_window_ms = 5000;
+module_param(flap_window_ms, uint, 0644);
+MODULE_PARM_DESC(flap_window_ms, "A device which is attached again within this time after its detach is flapping");
+
+//Events of one device which come closer than this to each other are folded into one record, 0 turns it off
+static unsigned int coalesce_window_ms;
+module_param(coalesce_window_ms, uint, 0644);
+MODULE_PARM_DESC(coalesce_window_ms, "Fold the events of a flapping device which are this close to each other into one record (0 disables it)");
+
+//Whether the hot paths time themselves, it costs two clock reads on each
+static bool perf_stats = true;
+module_param(perf_stats, bool, 0644);
+MODULE_PARM_DESC(perf_stats, "Keep latency histograms of the logger's own hot paths (in debugfs and IOCTL_LOG_PERF)");
+
+
+//Here are some useful variables
+
+//Creating a proc directory entry structure
+static struct proc_dir_entry* log_proc_file;
+static struct proc_dir_entry* dev_proc_file;
+static struct proc_dir_entry* stream_proc_file;
+static struct proc_dir_entry* devstats_proc_file;
+static struct proc_dir_entry* topo_proc_file;
+
+//Creating a waitequeue for yhe user process
+//Only stream readers sleep here until usb_notify appends a new record, opening the entries never waits
+static wait_queue_head_t our_queue;
+
+//Every device that has been seen has its own statistics, updated in usb_notify on each attach and detach
+//Readers only use RCU and copy an entry under device_lock, so they always see a consistent entry
+//Entries are never removed while the module is loaded, so the table only grows up to device_table_size
+struct usblog_device{
+	struct hlist_node node;
+	u32 key;
+	struct usblog_device_stats stats;
+	//The events of a flapping device are folded into storm instead of the rings, storm.repeats is zero if there is none
+	//Devices with a storm are on storm_list, both are protected by device_lock too
+	struct usblog_record storm;
+	struct list_head storm_node;
+	u64 last_event;
+};
+static DEFINE_HASHTABLE(device_table, DEVICE_HASH_BITS);
+static DEFINE_SPINLOCK(device_lock);
+static unsigned int device_count;
+static unsigned long device_untracked;
+static LIST_HEAD(storm_list);
+static void coalesce_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(coalesce_work, coalesce_work_fn);
+
+//What is attached right now, kept up to date by usb_notify so nobody has to walk sysfs for it
+//Each bus and device has one node keyed on its kernel structure, which is only compared and never looked into again
+//Nodes never change after they are added, so readers only use RCU and writers take topo_lock
+struct usblog_topo_node{
+	struct hlist_node node;
+	struct rcu_head rcu;
+	const void *key;
+	struct usblog_topo_entry entry;
+};
+static DEFINE_HASHTABLE(topo_table, TOPO_HASH_BITS);
+static DEFINE_SPINLOCK(topo_lock);
+static unsigned int topo_count;
+static u64 topo_generation;
+//The nodes are filled from the same fields as a record
+static void log_fill_device(struct usblog_record *event, struct usb_device *usbdev);
+
+//usb_notify only appends binary records, everything else happens later in this work in batches
+//The work item never runs twice at the same time, so its cursor and buffer need no lock
+static struct workqueue_struct *log_wq;
+static void log_work_fn(struct work_struct *work);
+static DECLARE_WORK(log_work, log_work_fn);
+static u64 log_work_cursor = 1;
+static struct usblog_record *log_work_batch;
+static struct ratelimit_state log_ratelimit;
+
+//The journal segment which is being filled, it is written to journal_slot of the file
+//The log work appends to it and the flush work writes it out if no new record comes for a while
+static struct file *journal_file;
+static struct usblog_journal_segment *journal_segment;
+static unsigned int journal_slot;
+static DEFINE_MUTEX(journal_mutex);
+static void journal_flush_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(journal_flush_work, journal_flush_fn);
+
+//Only the log work multicasts, so these need no lock, statistics requests only read them
+static struct genl_family log_genl_family;
+static bool log_genl_registered;
+static u64 log_genl_sent, log_genl_dropped;
+
+//Counters which are updated on every event, each CPU has its own copy and they are summed on read
+struct usblog_counters{
+	unsigned long dropped;
+	unsigned long matched;
+	unsigned long rejected;
+};
+static DEFINE_PER_CPU(struct usblog_counters, log_counters);
+
+//The cost of our own hot paths, each CPU fills its own histograms and they are summed on read just like the counters
+//Only the log work counts the overruns, so it needs no lock
+static DEFINE_PER_CPU(struct usblog_perf_hist, log_perf[USBLOG_PERF_NR]);
+static const char * const log_perf_names[USBLOG_PERF_NR] = {
+	"notify", "device_lock", "blocklist_lock", "work", "proc", "stream", "drain", "query",
+};
+static unsigned long log_work_overruns;
+static struct dentry *perf_debugfs_dir;
+
+//The rings are only the hot tier, the log work moves every record on to page sized chunks in sequence order
+//A chunk is a block of packed records (see log_pack_record), so a page holds hundreds of events instead of 64
+//The oldest chunks are freed when there are more than retention_events records, full chunks could be compressed
+//Readers take archive_rwsem for reading, only the log work and the trimming take it for writing
+//Readers merge the rings through one page of raw records at a time
+#define ARCHIVE_CHUNK_RECORDS (PAGE_SIZE / sizeof(struct usblog_record))
+//Each chunk keeps a zone map of its records (see struct usblog_zone), so queries could skip it without unpacking it
+struct usblog_chunk{
+	struct list_head node;
+	u64 first_seq, last_seq;
+	unsigned int count;
+	struct usblog_zone zone;
+	//Bytes of the page which hold packed records
+	size_t len;
+	//Zero while the records are in their page, otherwise the length of the compressed data
+	size_t packed_len;
+	void *data;
+};
+static LIST_HEAD(archive_chunks);
+static DECLARE_RWSEM(archive_rwsem);
+//Records before archive_next_seq are in the archive (or lost), the newer ones are only in the rings
+static u64 archive_next_seq = 1;
+static unsigned long archive_count, archive_nr_chunks, archive_nr_packed;
+static size_t archive_bytes;
+static u64 archive_evicted;
+//Working memory and output buffer of the compressor, only used under archive_rwsem
+static void *archive_wrkmem, *archive_packbuf;
+//The state of the last chunk, which is the only one records are appended to
+static struct usblog_packer archive_packer;
+
+
+
+//Sum one of the per-CPU counters
+#define log_counter_sum(field) ({				\
+	u64 __sum = 0;						\
+	int __cpu;						\
+	for_each_possible_cpu(__cpu)				\
+		__sum += per_cpu(log_counters, __cpu).field;	\
+	__sum;							\
+})
+
+
+//Memory that a chunk takes, this is what the statistics report
+static size_t archive_chunk_bytes(struct usblog_chunk *chunk){
+	return sizeof(*chunk) + (chunk->packed_len ? chunk->packed_len : PAGE_SIZE);
+}
+
+
+static struct usblog_chunk *archive_alloc_chunk(void){
+	struct usblog_chunk *chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+
+	if(!chunk)
+		return NULL;
+	chunk->data = (void *) __get_free_page(GFP_KERNEL);
+	if(!chunk->data){
+		kfree(chunk);
+		return NULL;
+	}
+	log_zone_init(&chunk->zone);
+	log_pack_init(&archive_packer);
+	return chunk;
+}
+
+
+//Unlink and free one chunk, the caller should hold archive_rwsem for writing
+static void archive_free_chunk(struct usblog_chunk *chunk){
+	list_del(&chunk->node);
+	archive_count -= chunk->count;
+	archive_nr_chunks--;
+	archive_bytes -= archive_chunk_bytes(chunk);
+	if(chunk->packed_len){
+		archive_nr_packed--;
+		kfree(chunk->data);
+	}
+	else
+		free_page((unsigned long) chunk->data);
+	kfree(chunk);
+}
+
+
+//Free the oldest chunks until the retention limit is kept, and the ones that were discarded as a whole
+//The caller should hold archive_rwsem for writing
+static void archive_trim_locked(void){
+	u64 tail_seq = log_header ? READ_ONCE(log_header->tail_seq) : 0;
+	unsigned long retention = READ_ONCE(retention_events);
+	struct usblog_chunk *chunk, *next;
+
+	list_for_each_entry_safe(chunk, next, &archive_chunks, node){
+		if(archive_count <= retention && chunk->last_seq >= tail_seq)
+			break;
+		if(chunk->last_seq >= tail_seq){
+			archive_evicted += chunk->count;
+			trace_usblogger_evict(chunk->first_seq, chunk->count, false);
+		}
+		archive_free_chunk(chunk);
+	}
+}
+
+
+static void archive_trim(void){
+	down_write(&archive_rwsem);
+	archive_trim_locked();
+	up_write(&archive_rwsem);
+}
+
+
+//A new retention limit takes effect at once, module_param_cb calls this for the sysfs parameter too
+static int retention_set(const char *val, const struct kernel_param *kp){
+	int err = param_set_ulong(val, kp);
+
+	if(!err)
+		archive_trim();
+	return err;
+}
+
+
+//Replace the page of a full chunk with its compressed copy, it stays as it is if that saves nothing
+//The records are already packed, so LZO only finds what repeats beyond the last few devices
+//The caller should hold archive_rwsem for writing, a page only takes a few microseconds
+static void archive_compress(struct usblog_chunk *chunk){
+	size_t len = lzo1x_worst_compress(PAGE_SIZE);
+	void *packed;
+
+	if(!archive_wrkmem || lzo1x_1_compress(chunk->data, chunk->len, archive_packbuf, &len, archive_wrkmem) != LZO_E_OK
+		|| len >= chunk->len)
+		return;
+	packed = kmemdup(archive_packbuf, len, GFP_KERNEL);
+	if(!packed)
+		return;
+	archive_bytes -= archive_chunk_bytes(chunk);
+	free_page((unsigned long) chunk->data);
+	chunk->data = packed;
+	chunk->packed_len = len;
+	archive_bytes += archive_chunk_bytes(chunk);
+	archive_nr_packed++;
+}
+
+
+//Readers of the archive decode one chunk at a time, the page is for the chunks which are compressed
+struct archive_reader{
+	struct usblog_packer unpacker;
+	const u8 *block;
+	size_t len, pos;
+	u8 page[PAGE_SIZE];
+};
+
+
+//Start reading the records of a chunk, returns false if a compressed chunk could not be unpacked
+static bool archive_read_chunk(struct usblog_chunk *chunk, struct archive_reader *reader){
+	size_t len = PAGE_SIZE;
+
+	log_pack_init(&reader->unpacker);
+	reader->pos = 0;
+	reader->block = chunk->data;
+	reader->len = chunk->len;
+	if(!chunk->packed_len)
+		return true;
+	if(lzo1x_decompress_safe(chunk->data, chunk->packed_len, reader->page, &len) != LZO_E_OK || len != chunk->len)
+		return false;
+	reader->block = reader->page;
+	return true;
+}
+
+
+//Decode the next record of the chunk, false at its end
+static bool archive_next_record(struct archive_reader *reader, struct usblog_record *rec){
+	return log_unpack_record(&reader->unpacker, reader->block, reader->len, &reader->pos, rec);
+}
+
+
+//Move a batch of records from the rings to the archive, they should be in sequence order
+//Only the log work calls this, and the journal replay before the log work could run
+static void archive_append(const struct usblog_record *records, unsigned int count){
+	struct usblog_chunk *chunk;
+	unsigned int i;
+
+	down_write(&archive_rwsem);
+	for(i=0; i<count; i++){
+		if(records[i].seq < archive_next_seq)
+			continue;
+		//Anything we have not seen before this record was overwritten in its ring
+		if(records[i].seq > archive_next_seq){
+			archive_evicted += records[i].seq - archive_next_seq;
+			trace_usblogger_evict(archive_next_seq, records[i].seq - archive_next_seq, true);
+		}
+		archive_next_seq = records[i].seq + 1;
+
+		//A compressed chunk is full, and so is one which could not take the record
+		chunk = list_empty(&archive_chunks) ? NULL : list_last_entry(&archive_chunks, struct usblog_chunk, node);
+		if(!chunk || chunk->packed_len || !log_pack_record(&archive_packer, &records[i], chunk->data, &chunk->len, PAGE_SIZE)){
+			if(chunk && !chunk->packed_len && READ_ONCE(compress_archive))
+				archive_compress(chunk);
+			chunk = archive_alloc_chunk();
+			if(!chunk){
+				archive_evicted++;
+				continue;
+			}
+			list_add_tail(&chunk->node, &archive_chunks);
+			archive_nr_chunks++;
+			archive_bytes += archive_chunk_bytes(chunk);
+			chunk->first_seq = records[i].seq;
+			log_pack_record(&archive_packer, &records[i], chunk->data, &chunk->len, PAGE_SIZE);
+		}
+		chunk->count++;
+		log_zone_add(&chunk->zone, &records[i]);
+		chunk->last_seq = records[i].seq;
+		archive_count++;
+	}
+	archive_trim_locked();
+	up_write(&archive_rwsem);
+}
+
+
+//Everything up to last_seq has been moved, the records we have not seen were overwritten in the rings
+static void archive_skip_to(u64 last_seq){
+	down_write(&archive_rwsem);
+	if(archive_next_seq <= last_seq){
+		archive_evicted += last_seq + 1 - archive_next_seq;
+		trace_usblogger_evict(archive_next_seq, last_seq + 1 - archive_next_seq, true);
+		archive_next_seq = last_seq + 1;
+	}
+	up_write(&archive_rwsem);
+}
+
+
+//Copy up to max archived records between from_seq and last_seq, the chunks are already in sequence order
+//end_seq is where the archive stops, newer records should be read from the rings
+static int archive_collect(u64 from_seq, u64 last_seq, struct usblog_record *out, unsigned int max, u64 *end_seq){
+	struct archive_reader *reader;
+	struct usblog_chunk *chunk;
+	struct usblog_record rec;
+	unsigned int count = 0;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if(!reader)
+		return -ENOMEM;
+
+	down_read(&archive_rwsem);
+	*end_seq = archive_next_seq;
+	list_for_each_entry(chunk, &archive_chunks, node){
+		if(count == max || chunk->first_seq > last_seq)
+			break;
+		if(chunk->last_seq < from_seq || !archive_read_chunk(chunk, reader))
+			continue;
+		while(count < max && archive_next_record(reader, &rec) && rec.seq <= last_seq)
+			if(rec.seq >= from_seq)
+				out[count++] = rec;
+	}
+	up_read(&archive_rwsem);
+
+	kfree(reader);
+	return count;
+}
+
+
+//Number of archived records from from_seq on, only a chunk with from_seq in the middle has to be read
+//Returns -ENOMEM rather than a count that leaves out such a chunk
+static long archive_count_from(u64 from_seq, u64 *end_seq){
+	struct archive_reader *reader;
+	struct usblog_chunk *chunk;
+	struct usblog_record rec;
+	long count = 0;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if(!reader)
+		return -ENOMEM;
+
+	down_read(&archive_rwsem);
+	*end_seq = archive_next_seq;
+	list_for_each_entry(chunk, &archive_chunks, node){
+		if(chunk->last_seq < from_seq)
+			continue;
+		if(chunk->first_seq >= from_seq){
+			count += chunk->count;
+			continue;
+		}
+		if(!archive_read_chunk(chunk, reader))
+			continue;
+		while(archive_next_record(reader, &rec))
+			count += rec.seq >= from_seq;
+	}
+	up_read(&archive_rwsem);
+
+	kfree(reader);
+	return count;
+}
+
+
+//Free the whole archive, nobody could read it anymore
+static void archive_free(void){
+	struct usblog_chunk *chunk, *next;
+
+	down_write(&archive_rwsem);
+	list_for_each_entry_safe(chunk, next, &archive_chunks, node)
+		archive_free_chunk(chunk);
+	up_write(&archive_rwsem);
+	kvfree(archive_wrkmem);
+	kvfree(archive_packbuf);
+	archive_wrkmem = archive_packbuf = NULL;
+}
+
+
+//Read the log in sequence order, first from the archive and then from the rings for the newer records
+//Returns the number of records copied, or a negative error code
+static int log_collect(u64 from_seq, u64 last_seq, struct usblog_record *out, unsigned int max){
+	u64 end_seq;
+	int count, more;
+
+	//Records before the tail have been discarded by a reset
+	from_seq = max_t(u64, from_seq, READ_ONCE(log_header->tail_seq));
+	count = archive_collect(from_seq, last_seq, out, max, &end_seq);
+	if(count < 0 || (unsigned int) count == max)
+		return count;
+	more = log_ring_collect(max_t(u64, from_seq, end_seq), last_seq, out + count, max - count);
+	if(more < 0)
+		return count ? count : more;
+	return count + more;
+}
+
+
+//Reject a blocked device the same way writing 0 to its authorized attribute in sysfs does
+//USB_DEVICE_ADD is sent while the device is locked by its probe, so we could drop the configuration right here,
+//that unbinds the interface drivers, and the device could not be configured again until it is authorized
+static bool blocklist_deauthorize(struct usb_device *usbdev){
+	//Never touch the root hubs, the whole bus would go away
+	if(!usbdev->parent || !usbdev->authorized)
+		return false;
+	usbdev->authorized = 0;
+	usb_set_configuration(usbdev, -1);
+	return true;
+}
+
+
+//Fill the statistics of the blocklist which all IOCTL_DEV_* queries use
+static void dev_fill_stats(struct usblog_dev_stats *stats){
+	blocklist_fill_stats(stats);
+	stats->matched = log_counter_sum(matched);
+	stats->rejected = log_counter_sum(rejected);
+}
+
+
+//Start timing a hot path, the clock is only read if somebody is going to use it
+static u64 log_perf_start(bool traced){
+	return traced || READ_ONCE(perf_stats) ? ktime_get_ns() : 0;
+}
+
+
+//Add the time since start to the histogram of a path on this CPU
+static void log_perf_end(enum usblog_perf_path path, u64 start){
+	struct usblog_perf_hist *hist;
+	u64 ns;
+
+	if(!start || !READ_ONCE(perf_stats))
+		return;
+	ns = ktime_get_ns() - start;
+	hist = get_cpu_ptr(&log_perf[path]);
+	hist->count++;
+	hist->sum += ns;
+	hist->max = max(hist->max, ns);
+	hist->buckets[ns ? min_t(unsigned int, ilog2(ns), USBLOG_PERF_BUCKETS - 1) : 0]++;
+	put_cpu_ptr(&log_perf[path]);
+}
+
+
+//Sum the histograms of all CPUs, a CPU could be in the middle of an update so this is only as exact as the counters
+static void log_perf_fill(struct usblog_perf_stats *stats){
+	struct usblog_perf_hist *hist;
+	int cpu, path, i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->version = USBLOG_STATS_VERSION;
+	stats->nr_paths = USBLOG_PERF_NR;
+	stats->nr_buckets = USBLOG_PERF_BUCKETS;
+	for_each_possible_cpu(cpu){
+		for(path=0; path<USBLOG_PERF_NR; path++){
+			hist = per_cpu_ptr(&log_perf[path], cpu);
+			stats->paths[path].count += READ_ONCE(hist->count);
+			stats->paths[path].sum += READ_ONCE(hist->sum);
+			stats->paths[path].max = max_t(u64, stats->paths[path].max, READ_ONCE(hist->max));
+			for(i=0; i<USBLOG_PERF_BUCKETS; i++)
+				stats->paths[path].buckets[i] += READ_ONCE(hist->buckets[i]);
+		}
+	}
+	stats->dropped = log_counter_sum(dropped);
+	stats->overruns = READ_ONCE(log_work_overruns);
+	stats->untracked = READ_ONCE(device_untracked);
+	stats->nl_dropped = READ_ONCE(log_genl_dropped);
+}
+
+
+//Start all the histograms from zero, the counters are not touched since the other statistics use them too
+static void log_perf_reset(void){
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&log_perf, cpu), 0, sizeof(log_perf));
+}
+
+
+//The hash key of a device and the port it is plugged in
+static u32 device_key(u16 vendor, u16 product, u16 busnum, const char *devpath){
+	return jhash(devpath, strnlen(devpath, USBLOG_DEVPATH_LEN), ((u32) vendor << 16 | product) ^ busnum);
+}
+
+
+//Find the entry of a device, the caller should be inside rcu_read_lock or hold device_lock
+static struct usblog_device *device_find(u32 key, u16 vendor, u16 product, u16 busnum, const char *devpath){
+	struct usblog_device *device;
+
+	hash_for_each_possible_rcu(device_table, device, node, key)
+		if(device->key == key && device->stats.vendor == vendor && device->stats.product == product
+			&& device->stats.busnum == busnum && !strncmp(device->stats.devpath, devpath, USBLOG_DEVPATH_LEN))
+			return device;
+	return NULL;
+}
+
+
+//Pair an attach with the following detach of the same device on the same port
+//The device notifiers could sleep, so a new entry is allocated before taking the lock
+//Returns the entry of the device, or NULL if the table is full, entries stay valid until the module is unloaded
+static struct usblog_device *device_update(const struct usblog_record *event){
+	struct usblog_device *device, *fresh = NULL;
+	u32 key = device_key(event->vendor, event->product, event->busnum, event->devpath);
+	u64 wait;
+
+	rcu_read_lock();
+	device = device_find(key, event->vendor, event->product, event->busnum, event->devpath);
+	rcu_read_unlock();
+	if(!device && READ_ONCE(device_count) < device_table_size){
+		fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+		if(fresh){
+			fresh->key = key;
+			fresh->stats.vendor = event->vendor;
+			fresh->stats.product = event->product;
+			fresh->stats.busnum = event->busnum;
+			memcpy(fresh->stats.devpath, event->devpath, USBLOG_DEVPATH_LEN);
+			fresh->stats.first_seen = event->timestamp;
+		}
+	}
+
+	wait = log_perf_start(false);
+	spin_lock(&device_lock);
+	log_perf_end(USBLOG_PERF_DEVICE_LOCK, wait);
+	//Another hub could have added the same device meanwhile
+	device = device_find(key, event->vendor, event->product, event->busnum, event->devpath);
+	if(!device && fresh && device_count < device_table_size){
+		hash_add_rcu(device_table, &fresh->node, key);
+		device_count++;
+		device = fresh;
+		fresh = NULL;
+	}
+	if(!device)
+		device_untracked++;
+	else if(event->action == USBLOG_ACTION_DEVICE_ADD){
+		if(device->stats.detaches && event->timestamp - device->stats.last_detach
+			< (u64) READ_ONCE(flap_window_ms) * NSEC_PER_MSEC)
+			device->stats.flaps++;
+		device->stats.attaches++;
+		device->stats.attached = 1;
+		device->stats.last_attach = event->timestamp;
+	}
+	else{
+		//A device which was plugged in before the module was loaded has no attach to pair with
+		if(device->stats.attached){
+			device->stats.last_dwell = event->timestamp - device->stats.last_attach;
+			device->stats.total_dwell += device->stats.last_dwell;
+		}
+		device->stats.detaches++;
+		device->stats.attached = 0;
+		device->stats.last_detach = event->timestamp;
+	}
+	spin_unlock(&device_lock);
+
+	kfree(fresh);
+	return device;
+}
+
+
+//Fold an event into the storm of its device if the previous event of the device is less than coalesce_window_ms old
+//Returns true if it is folded, then coalesce_work stores one aggregated record for the storm when it calms down
+static bool device_coalesce(struct usblog_device *device, const struct usblog_record *event){
+	unsigned int window_ms = READ_ONCE(coalesce_window_ms);
+	u64 first_ts;
+	u32 repeats;
+	u8 flags;
+	bool fold;
+
+	if(!window_ms)
+		return false;
+
+	spin_lock(&device_lock);
+	fold = device->last_event && event->timestamp - device->last_event < (u64) window_ms * NSEC_PER_MSEC;
+	device->last_event = event->timestamp;
+	if(fold){
+		if(!device->storm.repeats){
+			device->storm.first_ts = event->timestamp;
+			device->storm.flags = 0;
+			list_add_tail(&device->storm_node, &storm_list);
+		}
+		//The storm looks like its last event, but keeps the blocklist decisions of all of them
+		first_ts = device->storm.first_ts;
+		repeats = device->storm.repeats + 1;
+		flags = device->storm.flags | event->flags | USBLOG_FLAG_FLAPPING;
+		device->storm = *event;
+		device->storm.first_ts = first_ts;
+		device->storm.repeats = repeats;
+		device->storm.flags = flags;
+	}
+	spin_unlock(&device_lock);
+
+	if(fold)
+		queue_delayed_work(log_wq, &coalesce_work, msecs_to_jiffies(window_ms));
+	return fold;
+}
+
+
+//Store one aggregated record for every storm which has been quiet for a whole window, or for every storm if all is set
+//So the log and its readers only see one record for each incident, however fast the device flaps
+//Returns true if a storm is still pending
+static bool coalesce_store(bool all){
+	unsigned int window_ms = max(READ_ONCE(coalesce_window_ms), 1U);
+	u64 now = ktime_get_boot_ns(), window = (u64) window_ms * NSEC_PER_MSEC;
+	struct usblog_device *device, *tmp;
+	bool pending = false, stored = false;
+
+	spin_lock(&device_lock);
+	list_for_each_entry_safe(device, tmp, &storm_list, storm_node){
+		if(!all && now - device->last_event < window && now - device->storm.first_ts < COALESCE_MAX_WINDOWS * window){
+			pending = true;
+			continue;
+		}
+		//Storing never sleeps and never takes a lock, so it is fine under the spinlock
+		log_ring_store(&device->storm);
+		device->storm.repeats = 0;
+		list_del(&device->storm_node);
+		stored = true;
+	}
+	spin_unlock(&device_lock);
+
+	if(stored)
+		queue_work(log_wq, &log_work);
+	return pending;
+}
+
+
+static void coalesce_work_fn(struct work_struct *work){
+	if(coalesce_store(false))
+		queue_delayed_work(log_wq, &coalesce_work, msecs_to_jiffies(max(READ_ONCE(coalesce_window_ms), 1U)));
+}
+
+
+//Take a consistent copy of one entry
+static void device_copy(struct usblog_device *device, struct usblog_device_stats *stats){
+	spin_lock(&device_lock);
+	*stats = device->stats;
+	spin_unlock(&device_lock);
+}
+
+
+//Copy up to list->max entries of the table to userspace
+static int device_list(struct usblog_device_list *list){
+	struct usblog_device_stats *entries;
+	struct usblog_device *device;
+	unsigned int count = 0;
+	int bkt;
+
+	list->max = min(list->max, device_table_size);
+	entries = kvmalloc_array(max(list->max, 1U), sizeof(*entries), GFP_KERNEL);
+	if(!entries)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	hash_for_each_rcu(device_table, bkt, device, node){
+		if(count == list->max)
+			break;
+		device_copy(device, &entries[count++]);
+	}
+	rcu_read_unlock();
+
+	if(count && copy_to_user(u64_to_user_ptr(list->devices), entries, count * sizeof(*entries))){
+		kvfree(entries);
+		return -EFAULT;
+	}
+	list->count = count;
+	spin_lock(&device_lock);
+	list->total = device_count;
+	list->untracked = min_t(unsigned long, device_untracked, U32_MAX);
+	spin_unlock(&device_lock);
+
+	kvfree(entries);
+	return SUCCESS;
+}
+
+
+//Free the whole table, nobody could reach it anymore
+static void device_free(void){
+	struct usblog_device *device;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(device_table, bkt, tmp, device, node){
+		hash_del(&device->node);
+		kfree(device);
+	}
+	device_count = 0;
+}
+
+
+//Find the node of a bus or device, the caller should be inside rcu_read_lock or hold topo_lock
+static struct usblog_topo_node *topo_find(const void *key){
+	struct usblog_topo_node *topo;
+
+	hash_for_each_possible_rcu(topo_table, topo, node, (unsigned long) key)
+		if(topo->key == key)
+			return topo;
+	return NULL;
+}
+
+
+//Interface classes of a device as they were when it was added, zero if it is not in the cache
+static u32 topo_intf_classes(const void *key){
+	struct usblog_topo_node *topo;
+	u32 classes = 0;
+
+	rcu_read_lock();
+	topo = topo_find(key);
+	if(topo)
+		classes = topo->entry.intf_classes;
+	rcu_read_unlock();
+	return classes;
+}
+
+
+//Add a new node, unless the bus or device is already there or usbdev is gone meanwhile
+//Both could happen while the cache is seeded, because usb_notify is already running then
+static void topo_insert(struct usblog_topo_node *fresh, struct usb_device *usbdev){
+	spin_lock(&topo_lock);
+	//usb_disconnect marks the device before usb_notify removes it, so this could not leave a stale node
+	if(!topo_find(fresh->key) && !(usbdev && usbdev->state == USB_STATE_NOTATTACHED)){
+		hash_add_rcu(topo_table, &fresh->node, (unsigned long) fresh->key);
+		topo_count++;
+		topo_generation++;
+		fresh = NULL;
+	}
+	spin_unlock(&topo_lock);
+	kfree(fresh);
+}
+
+
+static void topo_remove(const void *key){
+	struct usblog_topo_node *topo;
+
+	spin_lock(&topo_lock);
+	topo = topo_find(key);
+	if(topo){
+		hash_del_rcu(&topo->node);
+		topo_count--;
+		topo_generation++;
+	}
+	spin_unlock(&topo_lock);
+	if(topo)
+		kfree_rcu(topo, rcu);
+}
+
+
+static void topo_add_bus(const struct usb_bus *bus){
+	struct usblog_topo_node *fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+
+	if(!fresh)
+		return;
+	fresh->key = bus;
+	fresh->entry.busnum = bus->busnum;
+	fresh->entry.flags = USBLOG_TOPO_BUS;
+	topo_insert(fresh, NULL);
+}
+
+
+//Most of a device comes from its record, attached is zero if it was there before the module was loaded
+static void topo_add_device(struct usb_device *usbdev, const struct usblog_record *event, u64 attached){
+	struct usblog_topo_node *fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+	struct usblog_topo_entry *entry;
+
+	if(!fresh)
+		return;
+	fresh->key = usbdev;
+	entry = &fresh->entry;
+	entry->busnum = event->busnum;
+	entry->devnum = event->devnum;
+	entry->parent = usbdev->parent ? usbdev->parent->devnum : 0;
+	entry->level = usbdev->level;
+	entry->portnum = usbdev->portnum;
+	entry->flags = event->dev_class == USB_CLASS_HUB ? USBLOG_TOPO_HUB : 0;
+	entry->speed = event->speed;
+	entry->vendor = event->vendor;
+	entry->product = event->product;
+	entry->dev_class = event->dev_class;
+	entry->serial_hash = event->serial_hash;
+	entry->intf_classes = event->intf_classes;
+	entry->attached = attached;
+	memcpy(entry->devpath, event->devpath, USBLOG_DEVPATH_LEN);
+	topo_insert(fresh, usbdev);
+}
+
+
+//Follow a notification, dev is a struct usb_device or a struct usb_bus just like in usb_notify
+static void topo_update(unsigned long action, void *dev, const struct usblog_record *event){
+	switch(action){
+		case USB_DEVICE_ADD:
+			topo_add_device(dev, event, event->timestamp);
+			break;
+		case USB_BUS_ADD:
+			topo_add_bus(dev);
+			break;
+		case USB_DEVICE_REMOVE:
+		case USB_BUS_REMOVE:
+			topo_remove(dev);
+			break;
+	}
+}
+
+
+//Everything which was attached before the module was loaded, the buses are found through their root hubs
+static int topo_seed_device(struct usb_device *usbdev, void *data){
+	struct usblog_record event = {0};
+
+	if(!usbdev->parent)
+		topo_add_bus(usbdev->bus);
+	//The notifier runs with the device locked, here the lock keeps the configuration from changing under the walk
+	usb_lock_device(usbdev);
+	log_fill_device(&event, usbdev);
+	usb_unlock_device(usbdev);
+	topo_add_device(usbdev, &event, 0);
+	return SUCCESS;
+}
+
+
+//Sort the entries like a walk of the tree, a bus has no path and a hub's path is a prefix of its children's
+static int topo_cmp(const void *a, const void *b){
+	const struct usblog_topo_entry *x = a, *y = b;
+
+	if(x->busnum != y->busnum)
+		return x->busnum < y->busnum ? -1 : 1;
+	return strncmp(x->devpath, y->devpath, USBLOG_DEVPATH_LEN);
+}
+
+
+//Copy the whole cache to a sorted array, it is O(attached devices) and never waits for a writer
+//If more was attached meanwhile than the array has room for, it is tried again with a bigger one
+//Returns the number of entries, or -EAGAIN if the cache kept growing, the caller should kvfree the array
+static int topo_snapshot(struct usblog_topo_entry **out, u64 *generation){
+	struct usblog_topo_entry *entries;
+	struct usblog_topo_node *topo;
+	unsigned int room = READ_ONCE(topo_count) + TOPO_SLACK, count, total, tries;
+	int bkt;
+
+	for(tries=0; tries<TOPO_SNAPSHOT_TRIES; tries++){
+		entries = kvmalloc_array(room, sizeof(*entries), GFP_KERNEL);
+		if(!entries)
+			return -ENOMEM;
+
+		count = total = 0;
+		rcu_read_lock();
+		*generation = READ_ONCE(topo_generation);
+		hash_for_each_rcu(topo_table, bkt, topo, node){
+			if(count < room)
+				entries[count++] = topo->entry;
+			total++;
+		}
+		rcu_read_unlock();
+
+		if(total <= room){
+			sort(entries, count, sizeof(*entries), topo_cmp, NULL);
+			*out = entries;
+			return count;
+		}
+		kvfree(entries);
+		room = total + TOPO_SLACK;
+	}
+	return -EAGAIN;
+}
+
+
+//Copy up to topo->max entries of the snapshot to userspace
+static int topo_list(struct usblog_topology *topo){
+	struct usblog_topo_entry *entries;
+	int count;
+
+	count = topo_snapshot(&entries, &topo->generation);
+	if(count < 0)
+		return count;
+	topo->total = count;
+	topo->count = min_t(u32, topo->max, count);
+	if(topo->count && copy_to_user(u64_to_user_ptr(topo->entries), entries, topo->count * sizeof(*entries))){
+		kvfree(entries);
+		return -EFAULT;
+	}
+	kvfree(entries);
+	return SUCCESS;
+}
+
+
+//Free the whole cache, nobody could reach it anymore
+static void topo_free(void){
+	struct usblog_topo_node *topo;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(topo_table, bkt, tmp, topo, node){
+		hash_del(&topo->node);
+		kfree(topo);
+	}
+	topo_count = 0;
+}
+
+
+
+//Fill the statistics of the log which the IOCTL_LOG_* queries use, fails only if the archive could not be read
+static int log_fill_stats(struct usblog_log_stats *stats){
+	long archived;
+	u64 end_seq;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->version = USBLOG_STATS_VERSION;
+	stats->esize = sizeof(struct usblog_record);
+	stats->head_seq = atomic64_read(log_sequence);
+	stats->tail_seq = READ_ONCE(log_header->tail_seq);
+	//The records which are not archived yet are counted in the rings
+	archived = archive_count_from(stats->tail_seq, &end_seq);
+	if(archived < 0)
+		return archived;
+	stats->count = archived;
+	stats->count += log_ring_count(max_t(u64, stats->tail_seq, end_seq));
+	stats->ring_size = log_ring_capacity();
+	stats->ring_bytes = PAGE_ALIGN(log_area_size);
+	stats->retention = READ_ONCE(retention_events);
+	stats->size = stats->ring_size + stats->retention;
+	stats->space = stats->size - min(stats->count, stats->size);
+	stats->full = stats->count >= stats->size;
+	stats->empty = stats->count == 0;
+	stats->events = stats->head_seq;
+	stats->dropped = log_counter_sum(dropped);
+
+	down_read(&archive_rwsem);
+	stats->evicted = archive_evicted;
+	stats->archive_count = archive_count;
+	stats->archive_chunks = archive_nr_chunks;
+	stats->archive_packed = archive_nr_packed;
+	stats->archive_bytes = archive_bytes;
+	up_read(&archive_rwsem);
+	return SUCCESS;
+}
+
+
+//Move the tail of the log forward, records before it will be skipped by all readers
+static void log_discard_before(u64 seq){
+	u64 tail = READ_ONCE(log_header->tail_seq);
+
+	//Several consumers could race here, the tail only ever moves forward
+	while(tail < seq){
+		u64 old = cmpxchg64(&log_header->tail_seq, tail, seq);
+		if(old == tail)
+			break;
+		tail = old;
+	}
+	//Chunks which are discarded as a whole are freed right away
+	archive_trim();
+}
+
+
+//Copy a batch of binary records to userspace with a single copy_to_user
+static int log_drain(struct usblog_drain *drain){
+	u64 start = log_perf_start(trace_usblogger_snapshot_enabled());
+	struct usblog_record *batch;
+	int i, count;
+	u64 last_seq, expected;
+
+	if(drain->max == 0 || drain->max > USBLOG_DRAIN_MAX || (drain->flags & ~USBLOG_DRAIN_CONSUME))
+		return -EINVAL;
+	if((drain->flags & USBLOG_DRAIN_CONSUME) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	batch = kvmalloc_array(drain->max, sizeof(*batch), GFP_KERNEL);
+	if(!batch)
+		return -ENOMEM;
+
+	//Nothing up to last_seq could show up later, so a cursor after it never skips a late record
+	expected = max_t(u64, drain->cursor, 1);
+	last_seq = log_ring_stable_seq();
+	count = log_collect(expected, last_seq, batch, drain->max);
+	if(count < 0){
+		kvfree(batch);
+		return count;
+	}
+
+	if(count && copy_to_user(u64_to_user_ptr(drain->records), batch, count * sizeof(*batch))){
+		kvfree(batch);
+		return -EFAULT;
+	}
+
+	//Every gap in the sequence numbers is a record that was evicted or discarded before we got to it
+	drain->lost = 0;
+	for(i=0; i<count; i++){
+		drain->lost += batch[i].seq - expected;
+		expected = batch[i].seq + 1;
+	}
+	if(count < (int) drain->max && last_seq + 1 > expected){
+		drain->lost += last_seq + 1 - expected;
+		expected = last_seq + 1;
+	}
+	drain->count = count;
+	trace_usblogger_snapshot(USBLOGGER_READER_DRAIN, drain->cursor, last_seq, count, start ? ktime_get_ns() - start : 0);
+	log_perf_end(USBLOG_PERF_DRAIN, start);
+	drain->cursor = expected;
+
+	if(drain->flags & USBLOG_DRAIN_CONSUME)
+		log_discard_before(expected);
+
+	kvfree(batch);
+	return SUCCESS;
+}
+
+
+//Look at the records from query->cursor on and copy the matching ones, up to query->max of them
+//Archived chunks are skipped by their zone map when they could not hold a match, the rings are small and read in full
+static int log_query(struct usblog_query *query){
+	u64 start = log_perf_start(trace_usblogger_snapshot_enabled());
+	struct usblog_record *matches, *records, rec;
+	struct archive_reader *reader;
+	struct usblog_chunk *chunk;
+	unsigned int count = 0, i;
+	u64 from_seq, last_seq, end_seq, next_seq;
+	int n = 0, err = SUCCESS;
+
+	if(query->max == 0 || query->max > USBLOG_DRAIN_MAX || (query->match & ~(USBLOG_QUERY_VENDOR | USBLOG_QUERY_PRODUCT
+		| USBLOG_QUERY_CLASS | USBLOG_QUERY_ACTION | USBLOG_QUERY_SINCE | USBLOG_QUERY_UNTIL)))
+		return -EINVAL;
+
+	matches = kvmalloc_array(query->max, sizeof(*matches), GFP_KERNEL);
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if(!matches || !reader){
+		kvfree(matches);
+		kfree(reader);
+		return -ENOMEM;
+	}
+
+	//Nothing up to last_seq could show up later, so next_seq never skips a late record
+	from_seq = max_t(u64, max_t(u64, query->cursor, 1), READ_ONCE(log_header->tail_seq));
+	last_seq = log_ring_stable_seq();
+	next_seq = last_seq + 1;
+	query->scanned = 0;
+
+	down_read(&archive_rwsem);
+	end_seq = archive_next_seq;
+	list_for_each_entry(chunk, &archive_chunks, node){
+		if(count == query->max || chunk->first_seq > last_seq)
+			break;
+		if(chunk->last_seq < from_seq || !log_zone_match(&chunk->zone, query) || !archive_read_chunk(chunk, reader))
+			continue;
+		while(count < query->max && archive_next_record(reader, &rec) && rec.seq <= last_seq){
+			if(rec.seq < from_seq)
+				continue;
+			query->scanned++;
+			if(log_query_match(query, &rec)){
+				matches[count++] = rec;
+				next_seq = rec.seq + 1;
+			}
+		}
+	}
+	up_read(&archive_rwsem);
+
+	//Then the records which are only in the rings, the page of the reader is reused as the merge buffer
+	records = (struct usblog_record *) reader->page;
+	from_seq = max(from_seq, end_seq);
+	while(count < query->max && (n = log_ring_collect(from_seq, last_seq, records, ARCHIVE_CHUNK_RECORDS)) > 0){
+		for(i=0; i<n && count<query->max; i++){
+			query->scanned++;
+			if(log_query_match(query, &records[i])){
+				matches[count++] = records[i];
+				next_seq = records[i].seq + 1;
+			}
+		}
+		from_seq = records[n - 1].seq + 1;
+	}
+	//A full buffer stops at the last match, otherwise everything up to last_seq has been looked at
+	//If the rings could not be merged, the next call should look at them again
+	if(count < query->max)
+		next_seq = n < 0 ? from_seq : last_seq + 1;
+
+	if(n < 0 && !count)
+		err = n;
+	else if(count && copy_to_user(u64_to_user_ptr(query->records), matches, count * sizeof(*matches)))
+		err = -EFAULT;
+	else{
+		query->count = count;
+		trace_usblogger_snapshot(USBLOGGER_READER_QUERY, query->cursor, last_seq, count, start ? ktime_get_ns() - start : 0);
+		log_perf_end(USBLOG_PERF_QUERY, start);
+		query->cursor = next_seq;
+	}
+
+	kvfree(matches);
+	kfree(reader);
+	return err;
+}
+
+
+//Check a new device against the blocklist and store its record, this is what usb_notify does for every event
+//usbdev is NULL for the bus events, they are never matched
+static void log_capture(struct usblog_record *event, struct usb_device *usbdev, struct usblog_device *device, u64 start){
+	struct usblog_rule *rule;
+	u8 rule_flags = 0;
+
+	//Search for the device in the blocklist, it is only a hash lookup under RCU
+	if(event->action == USBLOG_ACTION_DEVICE_ADD){
+		rcu_read_lock();
+		rule = blocklist_match(event, usbdev ? usbdev->serial : NULL);
+		if(rule){
+			if(usbdev){
+				this_cpu_inc(*rule->hits);
+				this_cpu_inc(log_counters.matched);
+			}
+			event->flags |= USBLOG_FLAG_BLOCKED;
+			rule_flags = rule->spec.flags;
+		}
+		rcu_read_unlock();
+		//A blocked device is rejected before anything else could use it
+		if(usbdev && (event->flags & USBLOG_FLAG_BLOCKED) && READ_ONCE(enforce_blocklist) && blocklist_deauthorize(usbdev)){
+			this_cpu_inc(log_counters.rejected);
+			event->flags |= USBLOG_FLAG_REJECTED;
+		}
+		if(event->flags & USBLOG_FLAG_BLOCKED)
+			trace_usblogger_block_match(event, rule_flags);
+	}
+
+	//A flapping device leaves one record for each storm, the blocklist above still checks every attach
+	if(device && device_coalesce(device, event))
+		return;
+
+	//Store the record in the ring of this CPU, no allocation and no shared lock here
+	log_ring_store(event);
+	trace_usblogger_capture(event, start ? ktime_get_ns() - start : 0);
+}
+
+
+//Print a boot time stamp as a wall-clock date and time with nanoseconds
+static void log_print_time(struct seq_file *m, u64 timestamp, s64 boot_to_real){
+	struct tm tm;
+	u32 nsec;
+	s64 sec = div_u64_rem(timestamp + boot_to_real, NSEC_PER_SEC, &nsec);
+
+	time64_to_tm(sec, 0, &tm);
+	seq_printf(m, "%04ld-%02d-%02d %02d:%02d:%02d.%09u", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec, nsec);
+}
+
+
+//The number of the statistics which a single number command returns
+static int log_stats_field(const struct usblog_log_stats *stats, unsigned int cmd){
+	switch(cmd){
+		case IOCTL_LOG_COUNT:
+			//This is how we could obtain the number of logs in the queue
+			return stats->count;
+		case IOCTL_LOG_SPACE:
+			//This is how we could obtain how many empty room left in the queue for new logs
+			return stats->space;
+		case IOCTL_LOG_SIZE:
+			//This ioctl signal will return the size of the queue in how many logs it could get
+			return stats->size;
+		case IOCTL_LOG_FULL:
+			//Here we check whether the queue is full or not
+			return stats->full;
+		case IOCTL_LOG_EMPTY:
+			//Just like the previous condition but here we check whether it is empty or not
+			return stats->empty;
+		default:
+			//Return the size of the element of the list
+			return stats->esize;
+	}
+}
+
+
+//When device recive ioctl commands this function will perform the job depending on what kind of command it recieved
+long log_proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+	struct usblog_log_stats stats;
+	struct usblog_drain drain;
+	struct usblog_query query;
+	struct usblog_device_list list;
+	struct usblog_perf_stats *perf;
+	struct usblog_topology topo;
+	u64 retention;
+	int err = 0;
+	
+	if(_IOC_TYPE(cmd) != LOG_MAGIC || _IOC_NR(cmd) > LOG_IOC_MAXNR)
+		return -ENOTTY;
+
+	if(_IOC_DIR(cmd) & _IOC_READ)
+		err = !access_ok(VERIFY_READ, (void __user *) arg, _IOC_SIZE(cmd));
+	if(_IOC_DIR(cmd) & _IOC_WRITE)
+		err = !access_ok(VERIFY_WRITE, (void __user *) arg, _IOC_SIZE(cmd));
+	if(err)
+		return -EFAULT;
+
+	switch(cmd){
+		case IOCTL_LOG_RESET:
+			//This command only works for system administrators
+			if(!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			//Here we just move the tail after the latest event, so readers will skip everything before it
+			log_discard_before(atomic64_read(log_sequence) + 1);
+			break;
+		case IOCTL_LOG_COUNT:
+		case IOCTL_LOG_SPACE:
+		case IOCTL_LOG_SIZE:
+		case IOCTL_LOG_FULL:
+		case IOCTL_LOG_EMPTY:
+		case IOCTL_LOG_ESIZE:
+			//Each of these is one number of the statistics, which are only worked out for the commands that return them
+			err = log_fill_stats(&stats);
+			if(err)
+				return err;
+			return put_user(log_stats_field(&stats, cmd), (int __user *) arg);
+		case IOCTL_LOG_DELETE:
+			//Delete the specified log from the linkedlist
+			//linkedlist_delete_item(arg);
+			break;
+		case IOCTL_LOG_STATS:
+			//Everything above and more in one call
+			err = log_fill_stats(&stats);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+				return -EFAULT;
+			break;
+		case IOCTL_LOG_DRAIN:
+			//Copy a whole batch of binary records instead of parsing the text of /proc/usblogger
+			if(copy_from_user(&drain, (void __user *) arg, sizeof(drain)))
+				return -EFAULT;
+			err = log_drain(&drain);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &drain, sizeof(drain)))
+				return -EFAULT;
+			break;
+		case IOCTL_LOG_RETAIN:
+			//Change how many records the archive keeps, the extra ones are freed at once
+			if(!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if(get_user(retention, (u64 __user *) arg))
+				return -EFAULT;
+			WRITE_ONCE(retention_events, retention);
+			archive_trim();
+			break;
+		case IOCTL_LOG_QUERY:
+			//Only the matching records are copied, so there is no need to read and grep the whole log
+			if(copy_from_user(&query, (void __user *) arg, sizeof(query)))
+				return -EFAULT;
+			err = log_query(&query);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &query, sizeof(query)))
+				return -EFAULT;
+			break;
+		case IOCTL_LOG_DEVICES:
+			//The aggregates of every device, so nobody has to work them out from the whole log
+			if(copy_from_user(&list, (void __user *) arg, sizeof(list)))
+				return -EFAULT;
+			err = device_list(&list);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &list, sizeof(list)))
+				return -EFAULT;
+			break;
+		case IOCTL_LOG_PERF:
+			//The histograms of all paths, this is too big for the stack
+			perf = kmalloc(sizeof(*perf), GFP_KERNEL);
+			if(!perf)
+				return -ENOMEM;
+			log_perf_fill(perf);
+			err = copy_to_user((void __user *) arg, perf, sizeof(*perf)) ? -EFAULT : SUCCESS;
+			kfree(perf);
+			return err;
+		case IOCTL_LOG_PERF_RESET:
+			if(!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			log_perf_reset();
+			break;
+		case IOCTL_LOG_TOPOLOGY:
+			//Everything which is attached right now, straight from the cache
+			if(copy_from_user(&topo, (void __user *) arg, sizeof(topo)))
+				return -EFAULT;
+			err = topo_list(&topo);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &topo, sizeof(topo)))
+				return -EFAULT;
+			break;
+		default:
+			return -ENOTTY;
+	}
+	return SUCCESS;
+}
+
+
+
+//Copy a rule batch from userspace and load it, length is zero when only the header knows it (IOCTL_DEV_LOAD)
+//Nothing is locked while the batch is copied and checked, if result is set the header goes back there with the results
+static int dev_load_batch(const char __user *buffer, size_t length, struct usblog_rule_batch __user *result){
+	struct usblog_rule_batch header, *batch;
+	size_t size;
+	int err;
+
+	if(copy_from_user(&header, buffer, sizeof(header)))
+		return -EFAULT;
+	size = sizeof(header) + (size_t) header.count * sizeof(struct usblog_rule_spec);
+	header.loaded = 0;
+	header.duplicates = 0;
+	header.error_index = header.count;
+
+	if(header.count > blocklist_size)
+		err = -ENOSPC;
+	else if(length && length != size)
+		err = -EINVAL;
+	else{
+		batch = kvmalloc(size, GFP_KERNEL);
+		if(!batch)
+			err = -ENOMEM;
+		else if(copy_from_user(batch, buffer, size))
+			err = -EFAULT;
+		else{
+			//Userspace could have changed the header meanwhile, so stick to the count we have allocated for
+			batch->count = header.count;
+			err = blocklist_load(batch);
+			memcpy(&header, batch, sizeof(header));
+			//The mutex is only held for the pointer swap, so there is no time worth reporting
+			trace_usblogger_blocklist_write(header.loaded, err, 0);
+		}
+		kvfree(batch);
+	}
+	header.error = err;
+
+	if(result && copy_to_user(result, &header, sizeof(header)))
+		return -EFAULT;
+	return err;
+}
+
+
+long dev_proc_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+	struct usblog_rule_hits hits;
+	struct usblog_dev_stats stats;
+	int err = 0;
+	
+	if(_IOC_TYPE(cmd) != DEV_MAGIC || _IOC_NR(cmd) > DEV_IOC_MAXNR)
+		return -ENOTTY;
+
+	if(_IOC_DIR(cmd) & _IOC_READ)
+		err = !access_ok(VERIFY_READ, (void __user *) arg, _IOC_SIZE(cmd));
+	if(_IOC_DIR(cmd) & _IOC_WRITE)
+		err = !access_ok(VERIFY_WRITE, (void __user *) arg, _IOC_SIZE(cmd));
+	if(err)
+		return -EFAULT;
+
+	//All the queries are answered from the same snapshot of the counters
+	dev_fill_stats(&stats);
+	
+	switch(cmd){
+		case IOCTL_DEV_RESET:
+			//This command only works for system administrators
+			if(!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			//Here just swap in an empty blocklist and free the old one after the readers are gone
+			return blocklist_reset();
+		case IOCTL_DEV_COUNT:
+			//This is how we could obtain the number of logs in the queue
+			return put_user((int) stats.count, (int __user *) arg);
+		case IOCTL_DEV_SPACE:
+			//This is how we could obtain how many empty room left in the queue for new logs
+			return put_user((int) stats.space, (int __user *) arg);
+		case IOCTL_DEV_SIZE:
+			//This ioctl signal will return the size of the queue in how many logs it could get
+			return put_user((int) stats.size, (int __user *) arg);
+		case IOCTL_DEV_FULL:
+			//Here we check whether the queue is full or not
+			return put_user((int) stats.full, (int __user *) arg);
+		case IOCTL_DEV_EMPTY:
+			//Just like the previous condition but here we check whether it is empty or not
+			return put_user((int) stats.empty, (int __user *) arg);
+		case IOCTL_DEV_ESIZE:
+			//Return the size of the element of the list
+			return put_user((int) stats.esize, (int __user *) arg);
+		case IOCTL_DEV_HITS:
+			//Return how many devices a rule has matched, so rejection rates could be measured
+			if(copy_from_user(&hits, (void __user *) arg, sizeof(hits)))
+				return -EFAULT;
+			err = blocklist_hits(&hits.spec, &hits.hits);
+			if(err)
+				return err;
+			if(copy_to_user((void __user *) arg, &hits, sizeof(hits)))
+				return -EFAULT;
+			break;
+		case IOCTL_DEV_STATS:
+			//Everything above and more in one call
+			if(copy_to_user((void __user *) arg, &stats, sizeof(stats)))
+				return -EFAULT;
+			break;
+		case IOCTL_DEV_LOAD:
+			//Replacing the whole blocklist is for system administrators only, like resetting it
+			if(!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			return dev_load_batch((const char __user *) arg, 0, (struct usblog_rule_batch __user *) arg);
+		default:
+			return -ENOTTY;
+	}
+	return SUCCESS;
+}
+
+
+
+
+//CRC-32 of a segment, computed with the crc field set to zero
+static u32 journal_crc(struct usblog_journal_segment *segment){
+	u32 saved = segment->crc, crc;
+
+	segment->crc = 0;
+	crc = crc32_le(~0, (unsigned char *) segment, sizeof(*segment) + segment->count * sizeof(struct usblog_record)) ^ ~0;
+	segment->crc = saved;
+	return crc;
+}
+
+
+//Write the current segment to its slot, the caller should hold journal_mutex
+static void journal_write_segment(void){
+	loff_t pos = (loff_t) journal_slot * USBLOG_JOURNAL_SEGMENT_SIZE;
+	ssize_t written;
+
+	journal_segment->boot_to_real = ktime_get_real_ns() - ktime_get_boot_ns();
+	journal_segment->crc = journal_crc(journal_segment);
+	written = kernel_write(journal_file, journal_segment, USBLOG_JOURNAL_SEGMENT_SIZE, &pos);
+	if(written != USBLOG_JOURNAL_SEGMENT_SIZE)
+		printk_ratelimited(KERN_WARNING "USBLOGGER: Journal Write Failure (%zd).\n", written);
+}
+
+
+//Start a new empty segment in the next slot, the oldest segment will be overwritten
+static void journal_next_segment(void){
+	u64 generation = journal_segment->generation;
+
+	memset(journal_segment, 0, USBLOG_JOURNAL_SEGMENT_SIZE);
+	journal_segment->magic = USBLOG_JOURNAL_MAGIC;
+	journal_segment->version = USBLOG_JOURNAL_VERSION;
+	journal_segment->generation = generation + 1;
+	journal_slot = (journal_slot + 1) % journal_segments;
+}
+
+
+//Append a batch of records to the journal, only full segments are written (and synced) right away
+static void journal_append(const struct usblog_record *records, unsigned int count){
+	unsigned int i;
+	bool pending;
+
+	mutex_lock(&journal_mutex);
+	for(i=0; i<count; i++){
+		journal_segment->records[journal_segment->count++] = records[i];
+		if(journal_segment->count == USBLOG_JOURNAL_RECORDS){
+			journal_write_segment();
+			vfs_fsync(journal_file, 1);
+			journal_next_segment();
+		}
+	}
+	pending = journal_segment->count > 0;
+	mutex_unlock(&journal_mutex);
+	//The rest is written a bit later, so a burst of events ends up in one write
+	if(pending)
+		mod_delayed_work(log_wq, &journal_flush_work, msecs_to_jiffies(journal_flush_ms));
+}
+
+
+//Write out the partly filled segment, it stays in its slot and will be written again when it grows
+static void journal_flush_fn(struct work_struct *work){
+	mutex_lock(&journal_mutex);
+	if(journal_file && journal_segment->count)
+		journal_write_segment();
+	mutex_unlock(&journal_mutex);
+}
+
+
+//Order the valid segments from the oldest to the newest
+static int journal_cmp_generation(const void *a, const void *b){
+	const struct usblog_journal_segment *x = *(const struct usblog_journal_segment **) a;
+	const struct usblog_journal_segment *y = *(const struct usblog_journal_segment **) b;
+
+	return x->generation < y->generation ? -1 : x->generation > y->generation;
+}
+
+
+//Read all valid segments back and store their records in the archive as replayed records
+//Records of an earlier boot get a negative boot time, so the wall-clock time we print stays right
+//and queries and zone maps, which compare times as signed numbers, put them before everything of this boot
+static void journal_replay(void){
+	struct usblog_journal_segment **valid, *segment;
+	unsigned int slot, found = 0, i, j;
+	u64 replayed = 0;
+	s64 boot_to_real;
+	loff_t pos;
+
+	valid = kcalloc(journal_segments, sizeof(*valid), GFP_KERNEL);
+	if(!valid)
+		return;
+
+	for(slot=0; slot<journal_segments; slot++){
+		segment = kmalloc(USBLOG_JOURNAL_SEGMENT_SIZE, GFP_KERNEL);
+		if(!segment)
+			break;
+		pos = (loff_t) slot * USBLOG_JOURNAL_SEGMENT_SIZE;
+		//Torn writes, empty slots and old versions fail these checks and are simply ignored
+		if(kernel_read(journal_file, segment, USBLOG_JOURNAL_SEGMENT_SIZE, &pos) != USBLOG_JOURNAL_SEGMENT_SIZE
+			|| segment->magic != USBLOG_JOURNAL_MAGIC || segment->version != USBLOG_JOURNAL_VERSION
+			|| segment->count > USBLOG_JOURNAL_RECORDS || segment->crc != journal_crc(segment)){
+			kfree(segment);
+			continue;
+		}
+		valid[found++] = segment;
+		if(segment->generation >= journal_segment->generation){
+			journal_segment->generation = segment->generation;
+			journal_slot = slot;
+		}
+	}
+
+	sort(valid, found, sizeof(*valid), journal_cmp_generation, NULL);
+	boot_to_real = ktime_get_real_ns() - ktime_get_boot_ns();
+	for(i=0; i<found; i++){
+		for(j=0; j<valid[i]->count; j++){
+			log_replay_record(&valid[i]->records[j], valid[i]->boot_to_real - boot_to_real);
+			//No event could arrive yet, so these sequence numbers are in order
+			valid[i]->records[j].seq = atomic64_inc_return(log_sequence);
+			replayed++;
+		}
+		archive_append(valid[i]->records, valid[i]->count);
+		kfree(valid[i]);
+	}
+	kfree(valid);
+
+	//New records go to a new segment after the newest one we have found
+	if(found)
+		journal_next_segment();
+	printk(KERN_INFO "USBLOGGER: %llu records replayed from %u journal segments.\n", replayed, found);
+}
+
+
+//Open the journal file and replay it, the module works without it if it could not be opened
+static void journal_open(void){
+	if(!journal_path || !*journal_path)
+		return;
+
+	journal_segments = clamp(journal_segments, 2U, 1U << 16);
+	journal_segment = kzalloc(USBLOG_JOURNAL_SEGMENT_SIZE, GFP_KERNEL);
+	if(!journal_segment)
+		return;
+	journal_segment->magic = USBLOG_JOURNAL_MAGIC;
+	journal_segment->version = USBLOG_JOURNAL_VERSION;
+
+	journal_file = filp_open(journal_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if(IS_ERR(journal_file)){
+		printk(KERN_ALERT "USBLOGGER: Journal %s Could Not Be Opened (%ld).\n", journal_path, PTR_ERR(journal_file));
+		journal_file = NULL;
+		kfree(journal_segment);
+		journal_segment = NULL;
+		return;
+	}
+	journal_replay();
+	//The replayed records are already in the journal and the archive, the log work should skip them
+	log_work_cursor = atomic64_read(log_sequence) + 1;
+}
+
+
+//Write out what is left and close the journal
+static void journal_close(void){
+	cancel_delayed_work_sync(&journal_flush_work);
+	if(journal_file){
+		if(journal_segment->count)
+			journal_write_segment();
+		vfs_fsync(journal_file, 0);
+		filp_close(journal_file, NULL);
+		journal_file = NULL;
+	}
+	kfree(journal_segment);
+	journal_segment = NULL;
+}
+
+
+//Put one record in the attributes of a message
+static int log_genl_put_record(struct sk_buff *skb, const struct usblog_record *rec){
+	char devpath[USBLOG_DEVPATH_LEN + 1];
+
+	//The path in a record is not always terminated, the attribute is a proper string
+	memcpy(devpath, rec->devpath, USBLOG_DEVPATH_LEN);
+	devpath[USBLOG_DEVPATH_LEN] = '\0';
+	if(nla_put_u64_64bit(skb, USBLOG_ATTR_EV_SEQ, rec->seq, USBLOG_ATTR_PAD)
+		|| nla_put_u64_64bit(skb, USBLOG_ATTR_EV_TIMESTAMP, rec->timestamp, USBLOG_ATTR_PAD)
+		|| nla_put_u16(skb, USBLOG_ATTR_EV_VENDOR, rec->vendor)
+		|| nla_put_u16(skb, USBLOG_ATTR_EV_PRODUCT, rec->product)
+		|| nla_put_u8(skb, USBLOG_ATTR_EV_ACTION, rec->action)
+		|| nla_put_u8(skb, USBLOG_ATTR_EV_CLASS, rec->dev_class)
+		|| nla_put_u8(skb, USBLOG_ATTR_EV_FLAGS, rec->flags)
+		|| nla_put_u16(skb, USBLOG_ATTR_EV_BUSNUM, rec->busnum)
+		|| nla_put_string(skb, USBLOG_ATTR_EV_DEVPATH, devpath)
+		|| nla_put_u8(skb, USBLOG_ATTR_EV_SPEED, rec->speed)
+		|| nla_put_u32(skb, USBLOG_ATTR_EV_SERIAL_HASH, rec->serial_hash)
+		|| nla_put_u32(skb, USBLOG_ATTR_EV_INTF_CLASSES, rec->intf_classes))
+		return -EMSGSIZE;
+	if((rec->flags & USBLOG_FLAG_FLAPPING) && (nla_put_u32(skb, USBLOG_ATTR_EV_REPEATS, rec->repeats)
+		|| nla_put_u64_64bit(skb, USBLOG_ATTR_EV_FIRST_TS, rec->first_ts, USBLOG_ATTR_PAD)))
+		return -EMSGSIZE;
+	return SUCCESS;
+}
+
+
+static const struct nla_policy log_genl_policy[USBLOG_ATTR_MAX + 1] = {
+	[USBLOG_ATTR_RULE] = { .len = sizeof(struct usblog_rule_spec) },
+};
+
+
+//Answer with the same statistics that IOCTL_LOG_STATS and IOCTL_DEV_STATS return, and our own counters
+static int log_genl_get_stats(struct sk_buff *skb, struct genl_info *info){
+	struct usblog_log_stats log_stats;
+	struct usblog_dev_stats dev_stats;
+	struct sk_buff *reply;
+	void *hdr;
+	int err;
+
+	err = log_fill_stats(&log_stats);
+	if(err)
+		return err;
+	dev_fill_stats(&dev_stats);
+
+	reply = genlmsg_new(nla_total_size(sizeof(log_stats)) + nla_total_size(sizeof(dev_stats))
+		+ 2 * nla_total_size_64bit(sizeof(u64)), GFP_KERNEL);
+	if(!reply)
+		return -ENOMEM;
+	hdr = genlmsg_put_reply(reply, info, &log_genl_family, 0, USBLOG_CMD_GET_STATS);
+	if(!hdr || nla_put(reply, USBLOG_ATTR_LOG_STATS, sizeof(log_stats), &log_stats)
+		|| nla_put(reply, USBLOG_ATTR_DEV_STATS, sizeof(dev_stats), &dev_stats)
+		|| nla_put_u64_64bit(reply, USBLOG_ATTR_NL_SENT, READ_ONCE(log_genl_sent), USBLOG_ATTR_PAD)
+		|| nla_put_u64_64bit(reply, USBLOG_ATTR_NL_DROPPED, READ_ONCE(log_genl_dropped), USBLOG_ATTR_PAD)){
+		nlmsg_free(reply);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(reply, hdr);
+	return genlmsg_reply(reply, info);
+}
+
+
+//Add or remove one rule, it is the same binary rule that IOCTL_DEV_HITS takes
+static int log_genl_block(struct sk_buff *skb, struct genl_info *info){
+	struct usblog_rule_spec spec;
+	u64 wait;
+	int err;
+
+	if(!netlink_capable(skb, CAP_SYS_ADMIN))
+		return -EPERM;
+	if(!info->attrs[USBLOG_ATTR_RULE] || nla_len(info->attrs[USBLOG_ATTR_RULE]) != sizeof(spec))
+		return -EINVAL;
+	nla_memcpy(&spec, info->attrs[USBLOG_ATTR_RULE], sizeof(spec));
+	if(spec.flags & ~(USBLOG_RULE_CLASS | USBLOG_RULE_SERIAL))
+		return -EINVAL;
+
+	wait = log_perf_start(false);
+	mutex_lock(&blocklist_mutex);
+	log_perf_end(USBLOG_PERF_BLOCKLIST_LOCK, wait);
+	if(info->genlhdr->cmd == USBLOG_CMD_BLOCK_ADD)
+		err = blocklist_add(&spec);
+	else
+		err = blocklist_del(&spec);
+	mutex_unlock(&blocklist_mutex);
+	return err;
+}
+
+
+static int log_genl_block_reset(struct sk_buff *skb, struct genl_info *info){
+	if(!netlink_capable(skb, CAP_SYS_ADMIN))
+		return -EPERM;
+	return blocklist_reset();
+}
+
+
+//Each operation has its own policy, managing the blocklist is only for administrators
+//GENL_ADMIN_PERM only asks for CAP_NET_ADMIN, so the handlers check for CAP_SYS_ADMIN like the ioctls do
+static const struct genl_ops log_genl_ops[] = {
+	{
+		.cmd = USBLOG_CMD_GET_STATS,
+		.doit = log_genl_get_stats,
+		.policy = log_genl_policy,
+	},
+	{
+		.cmd = USBLOG_CMD_BLOCK_ADD,
+		.doit = log_genl_block,
+		.policy = log_genl_policy,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = USBLOG_CMD_BLOCK_DEL,
+		.doit = log_genl_block,
+		.policy = log_genl_policy,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = USBLOG_CMD_BLOCK_RESET,
+		.doit = log_genl_block_reset,
+		.policy = log_genl_policy,
+		.flags = GENL_ADMIN_PERM,
+	},
+};
+
+static const struct genl_multicast_group log_genl_mcgrps[] = {
+	{ .name = USBLOG_GENL_MCGRP, },
+};
+
+static struct genl_family log_genl_family = {
+	.name = USBLOG_GENL_NAME,
+	.version = USBLOG_GENL_VERSION,
+	.maxattr = USBLOG_ATTR_MAX,
+	.module = THIS_MODULE,
+	.ops = log_genl_ops,
+	.n_ops = ARRAY_SIZE(log_genl_ops),
+	.mcgrps = log_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(log_genl_mcgrps),
+};
+
+
+//Multicast a batch of records, each one is encoded once however many daemons have subscribed
+//A subscriber which does not read fast enough loses messages, we count them as dropped
+static void log_genl_publish(const struct usblog_record *records, unsigned int count){
+	struct sk_buff *skb;
+	unsigned int i;
+	void *hdr;
+	int err;
+
+	if(!log_genl_registered || !genl_has_listeners(&log_genl_family, &init_net, 0))
+		return;
+
+	for(i=0; i<count; i++){
+		skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+		if(!skb){
+			log_genl_dropped++;
+			continue;
+		}
+		hdr = genlmsg_put(skb, 0, 0, &log_genl_family, 0, USBLOG_CMD_EVENT);
+		if(!hdr || log_genl_put_record(skb, &records[i])){
+			nlmsg_free(skb);
+			log_genl_dropped++;
+			continue;
+		}
+		genlmsg_end(skb, hdr);
+		//The message is consumed even on failure, ESRCH only means the last subscriber has gone meanwhile
+		err = genlmsg_multicast(&log_genl_family, skb, 0, 0, GFP_KERNEL);
+		if(!err)
+			log_genl_sent++;
+		else if(err != -ESRCH)
+			log_genl_dropped++;
+	}
+}
+
+
+//Report the records that usb_notify has appended since the last run
+//Formatting and printing happen here, far away from the notifier chain and the device bring-up
+static void log_work_fn(struct work_struct *work){
+	u64 start = log_perf_start(false);
+	u64 last_seq = log_ring_stable_seq();
+	bool print = READ_ONCE(kernel_log);
+	int i, count;
+
+	//Records which have been discarded by a reset are not overruns
+	log_work_cursor = max_t(u64, log_work_cursor, READ_ONCE(log_header->tail_seq));
+	while((count = log_ring_collect(log_work_cursor, last_seq, log_work_batch, LOG_BATCH_LEN)) > 0){
+		//Any gap in the sequence numbers is a record which was overwritten before we got to it
+		log_work_overruns += log_work_batch[count - 1].seq + 1 - log_work_cursor - count;
+		archive_append(log_work_batch, count);
+		log_work_cursor = log_work_batch[count - 1].seq + 1;
+		for(i=0; print && i<count; i++){
+			if(!__ratelimit(&log_ratelimit))
+				break;
+			printk(KERN_INFO "USBLOGGER: %04X:%04X %s%c %u-%.*s%s\n", log_work_batch[i].vendor, log_work_batch[i].product,
+				log_action_name(log_work_batch[i].action), identify_record_class_type(&log_work_batch[i]),
+				log_work_batch[i].busnum, USBLOG_DEVPATH_LEN, log_work_batch[i].devpath, log_flags_name(log_work_batch[i].flags));
+		}
+		//Every record goes to the journal and the archive, even when the kernel log is rate limited
+		if(journal_file)
+			journal_append(log_work_batch, count);
+		log_genl_publish(log_work_batch, count);
+		if(count < LOG_BATCH_LEN)
+			break;
+	}
+	//Records that have been overwritten before we got here are simply skipped
+	if(log_work_cursor <= last_seq){
+		log_work_overruns += last_seq + 1 - log_work_cursor;
+		log_work_cursor = last_seq + 1;
+	}
+	archive_skip_to(last_seq);
+
+	//Stream readers are woken up once for the whole batch
+	wake_up_interruptible(&our_queue);
+	log_perf_end(USBLOG_PERF_WORK, start);
+}
+
+
+///proc/usblogger is read with a real seq_file iterator, its position is the sequence number of the next record
+//Each read() merges the rings and the archive in small batches from there, so nothing is locked between batches
+//and a reader only pays for the records it actually fetches, however long the retention is
+struct log_proc_iter{
+	struct usblog_record batch[LOG_BATCH_LEN];
+	unsigned int count, index;
+	u64 last_seq;
+	s64 boot_to_real;
+	//For the snapshot tracepoint of each read()
+	u64 start, first_seq, shown;
+};
+
+
+//Fill the batch with the records from *pos on, and move *pos to the first one we have got
+static struct usblog_record *log_seq_fetch(struct log_proc_iter *iter, loff_t *pos){
+	int count = log_collect(max_t(u64, *pos, 1), iter->last_seq, iter->batch, LOG_BATCH_LEN);
+
+	iter->index = 0;
+	iter->count = max(count, 0);
+	if(count < 0)
+		return ERR_PTR(count);
+	if(count == 0){
+		//Nothing is left in this snapshot, the records that were overwritten meanwhile are skipped
+		if(iter->last_seq >= (u64) *pos)
+			*pos = iter->last_seq + 1;
+		return NULL;
+	}
+	*pos = iter->batch[0].seq;
+	return &iter->batch[0];
+}
+
+
+//Every read() sees the records up to the latest stable sequence number, the next one continues after the last record it printed
+static void *log_seq_start(struct seq_file *m, loff_t *pos){
+	struct log_proc_iter *iter = m->private;
+
+	iter->start = log_perf_start(trace_usblogger_snapshot_enabled());
+	iter->shown = 0;
+	iter->last_seq = log_ring_stable_seq();
+	//Records keep the raw boot time, the wall-clock time is only worked out here for printing
+	iter->boot_to_real = ktime_get_real_ns() - ktime_get_boot_ns();
+	iter->first_seq = max_t(u64, *pos, 1);
+	return log_seq_fetch(iter, pos);
+}
+
+
+static void *log_seq_next(struct seq_file *m, void *v, loff_t *pos){
+	struct log_proc_iter *iter = m->private;
+
+	if(++iter->index < iter->count){
+		*pos = iter->batch[iter->index].seq;
+		return &iter->batch[iter->index];
+	}
+	*pos = iter->batch[iter->count - 1].seq + 1;
+	return log_seq_fetch(iter, pos);
+}
+
+
+static void log_seq_stop(struct seq_file *m, void *v){
+	struct log_proc_iter *iter = m->private;
+
+	if(!iter->shown)
+		return;
+	trace_usblogger_snapshot(USBLOGGER_READER_PROC, iter->first_seq, iter->last_seq, iter->shown,
+		iter->start ? ktime_get_ns() - iter->start : 0);
+	log_perf_end(USBLOG_PERF_PROC, iter->start);
+}
+
+
+//Print one record, the line starts with its sequence number so it could be used with lseek
+static int log_seq_show(struct seq_file *m, void *v){
+	struct log_proc_iter *iter = m->private;
+	struct usblog_record *rec = v;
+
+	seq_printf(m, "%llu: %04X:%04X %s%c ", rec->seq, rec->vendor, rec->product,
+		log_action_name(rec->action), identify_record_class_type(rec));
+	log_print_time(m, rec->timestamp, iter->boot_to_real);
+	seq_printf(m, "%s", log_flags_name(rec->flags));
+	//An aggregated record tells how many events it stands for and when the storm started
+	if(rec->flags & USBLOG_FLAG_FLAPPING){
+		seq_printf(m, " repeats=%u since=", rec->repeats);
+		log_print_time(m, rec->first_ts, iter->boot_to_real);
+	}
+	//Where the device was plugged in and how fast it is, bus events only have the bus number
+	if(rec->action == USBLOG_ACTION_DEVICE_ADD || rec->action == USBLOG_ACTION_DEVICE_REMOVE)
+		seq_printf(m, " port=%u-%.*s speed=%s serial=%08X\n", rec->busnum, USBLOG_DEVPATH_LEN, rec->devpath,
+			usb_speed_string(rec->speed), rec->serial_hash);
+	else
+		seq_printf(m, " bus=%u\n", rec->busnum);
+	iter->shown++;
+	return SUCCESS;
+}
+
+
+static const struct seq_operations log_seq_ops = {
+	.start = log_seq_start,
+	.next = log_seq_next,
+	.stop = log_seq_stop,
+	.show = log_seq_show,
+};
+
+
+//This is where system functionallity triggers every time some process try to read from our proc entry
+static int log_proc_open(struct inode *inode, struct file *file){
+	//There is no open exclusion, any number of readers could follow the log at the same time
+	//Eachtime you open the entry point, infact you are using the device, so you have to
+	//count the references to it, in order to when you want to release it, you could safely release
+	//the device with reference count of zero
+	//So we increase the reference count using try_module_get
+	try_module_get(THIS_MODULE);
+	//And now we will process the request, each reader has its own batch
+	if(!__seq_open_private(file, &log_seq_ops, sizeof(struct log_proc_iter))){
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	return SUCCESS;
+}
+
+
+//seq_read would move the file position by the bytes it has copied, but the position of this file is a sequence number
+//So seq_read gets the byte position it keeps for itself, and the file gets the sequence number of the next record
+//A record which has only been read in part counts as read, the rest of its line comes with the next read()
+static ssize_t log_proc_read(struct file *file, char __user *buf, size_t size, loff_t *ppos){
+	struct seq_file *m = file->private_data;
+	loff_t pos = m->read_pos;
+	ssize_t ret = seq_read(file, buf, size, &pos);
+
+	if(ret > 0)
+		*ppos = m->index;
+	return ret;
+}
+
+
+//The position is a sequence number, so SEEK_SET jumps straight to a record and SEEK_END to the next new one
+//seq_lseek would format everything before the offset again, here nothing is printed until the next read()
+static loff_t log_proc_llseek(struct file *file, loff_t offset, int whence){
+	struct seq_file *m = file->private_data;
+
+	switch(whence){
+		case SEEK_SET:
+			if(offset < 0)
+				return -EINVAL;
+			break;
+		case SEEK_CUR:
+			if(offset)
+				return -EINVAL;
+			//The iterator has already moved on to the next record, whatever is left in the buffer
+			mutex_lock(&m->lock);
+			offset = m->index;
+			file->f_pos = offset;
+			mutex_unlock(&m->lock);
+			return offset;
+		case SEEK_END:
+			offset = atomic64_read(log_sequence) + 1;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	//Drop what is buffered and let seq_read start the iterator from the new sequence number
+	mutex_lock(&m->lock);
+	m->index = offset;
+	m->count = 0;
+	m->from = 0;
+	m->read_pos = offset;
+	file->f_pos = offset;
+	mutex_unlock(&m->lock);
+	return offset;
+}
+
+
+//Each time you release the /dev entry after read or write somthing from and to /dev entry
+//This function have to adjust the reference count and does its job
+static int log_proc_release(struct inode *inode, struct file *file){
+	//When you release the entry point, that means you have finished with the device so
+	//decrese the reference count wit module_put
+	module_put(THIS_MODULE);
+	//And finally release the file and the iterator
+	return seq_release_private(inode, file);
+}
+
+
+//Userspace could map the header and the rings to read new records without any system call or copy
+//The mapping is read-only, writers are only in the kernel
+static int log_proc_mmap(struct file *file, struct vm_area_struct *vma){
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if(vma->vm_end - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT) > PAGE_ALIGN(log_area_size))
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, log_header, vma->vm_pgoff);
+}
+
+
+
+//Each reader of the event stream has its own cursor, which is the next sequence number it wants
+//We keep it in f_pos, so lseek could move it and every open file follows the log independently
+static bool stream_has_records(loff_t cursor){
+	return atomic64_read(log_sequence) >= (u64) cursor;
+}
+
+
+//Stream readers get fixed-size binary records, starting from the oldest one that is still in the rings
+//The archive is not replayed to a new reader, SEEK_SET to 1 (or any older sequence number) reads it from there
+static int stream_proc_open(struct inode *inode, struct file *file){
+	try_module_get(THIS_MODULE);
+	file->f_pos = max_t(u64, max_t(u64, 1, READ_ONCE(log_header->tail_seq)), log_ring_oldest_seq());
+	return SUCCESS;
+}
+
+
+//Copy as many complete records as fit in the user buffer, and block until there is at least one
+static ssize_t stream_proc_read(struct file *file, char __user *buffer, size_t length, loff_t *off){
+	u64 start = log_perf_start(trace_usblogger_snapshot_enabled()), from_seq = *off;
+	struct usblog_record *batch;
+	//A huge buffer is only filled up to USBLOG_DRAIN_MAX records, the count has to fit in an unsigned int
+	unsigned int max = min_t(size_t, length / sizeof(struct usblog_record), USBLOG_DRAIN_MAX);
+	ssize_t copied = 0;
+	int count;
+	u64 last_seq;
+
+	if(max == 0)
+		return -EINVAL;
+
+	batch = kmalloc_array(LOG_BATCH_LEN, sizeof(*batch), GFP_KERNEL);
+	if(!batch)
+		return -ENOMEM;
+
+	for(;;){
+		last_seq = log_ring_stable_seq();
+		count = log_collect(*off, last_seq, batch, min_t(unsigned int, max, LOG_BATCH_LEN));
+		if(count < 0){
+			if(!copied)
+				copied = count;
+			break;
+		}
+		if(count > 0){
+			if(copy_to_user(buffer + copied, batch, count * sizeof(*batch))){
+				if(!copied)
+					copied = -EFAULT;
+				break;
+			}
+			copied += count * sizeof(*batch);
+			max -= count;
+			*off = batch[count - 1].seq + 1;
+			if(max == 0)
+				break;
+			continue;
+		}
+		//Nothing in range is left, so the cursor could skip the records that were overwritten
+		if(last_seq >= (u64) *off)
+			*off = last_seq + 1;
+		if(copied)
+			break;
+		//If user process can not wait for new records, just tell it to try again later
+		if(file->f_flags & O_NONBLOCK){
+			copied = -EAGAIN;
+			break;
+		}
+		if(wait_event_interruptible(our_queue, stream_has_records(*off))){
+			copied = -ERESTARTSYS;
+			break;
+		}
+	}
+
+	//The time we slept waiting for new records is part of the duration too
+	if(copied > 0){
+		trace_usblogger_snapshot(USBLOGGER_READER_STREAM, from_seq, *off - 1, copied / sizeof(*batch),
+			start ? ktime_get_ns() - start : 0);
+		log_perf_end(USBLOG_PERF_STREAM, start);
+	}
+
+	kfree(batch);
+	return copied;
+}
+
+
+//poll, select and epoll report the stream as readable once there is anything after the cursor
+static __poll_t stream_proc_poll(struct file *file, poll_table *wait){
+	poll_wait(file, &our_queue, wait);
+	return stream_has_records(file->f_pos) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+
+//The cursor could be moved to a sequence number with SEEK_SET, or to the next new event with SEEK_END
+static loff_t stream_proc_llseek(struct file *file, loff_t offset, int whence){
+	switch(whence){
+		case SEEK_SET:
+			if(offset < 0)
+				return -EINVAL;
+			file->f_pos = offset;
+			break;
+		case SEEK_END:
+			file->f_pos = atomic64_read(log_sequence) + 1;
+			break;
+		default:
+			return -EINVAL;
+	}
+	return file->f_pos;
+}
+
+
+static int stream_proc_release(struct inode *inode, struct file *file){
+	module_put(THIS_MODULE);
+	return SUCCESS;
+}
+
+
+
+
+
+
+
+
+//One line for each device with its attach counts, dwell times in milliseconds and flaps per hour
+static int devstats_proc_show(struct seq_file *m, void *v){
+	struct usblog_device_stats stats;
+	struct usblog_device *device;
+	u64 now = ktime_get_boot_ns(), seen;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu(device_table, bkt, device, node){
+		device_copy(device, &stats);
+		//Flap rate is worked out over the time since we first saw the device, at least one minute
+		seen = max_t(u64, now - stats.first_seen, 60 * NSEC_PER_SEC);
+		seq_printf(m, "%04X:%04X %u-%.*s attaches=%llu detaches=%llu attached=%u dwell_total=%llums dwell_last=%llums"
+			" flaps=%llu flap_rate=%llu/h\n", stats.vendor, stats.product, stats.busnum, USBLOG_DEVPATH_LEN, stats.devpath,
+			stats.attaches, stats.detaches, stats.attached, div_u64(stats.total_dwell, NSEC_PER_MSEC),
+			div_u64(stats.last_dwell, NSEC_PER_MSEC), stats.flaps, div64_u64(stats.flaps * 3600 * NSEC_PER_SEC, seen));
+	}
+	rcu_read_unlock();
+
+	return SUCCESS;
+}
+
+
+static int devstats_proc_open(struct inode *inode, struct file *file){
+	try_module_get(THIS_MODULE);
+	return single_open(file, devstats_proc_show, NULL);
+}
+
+
+static int devstats_proc_release(struct inode *inode, struct file *file){
+	module_put(THIS_MODULE);
+	return single_release(inode, file);
+}
+
+
+//One line for each bus, and its devices under it indented by their level
+static int topo_proc_show(struct seq_file *m, void *v){
+	struct usblog_topo_entry *entries, *entry;
+	struct usblog_record rec = {0};
+	u64 generation;
+	int i, count;
+
+	count = topo_snapshot(&entries, &generation);
+	if(count < 0)
+		return count;
+
+	for(i=0; i<count; i++){
+		entry = &entries[i];
+		if(entry->flags & USBLOG_TOPO_BUS){
+			seq_printf(m, "bus %u\n", entry->busnum);
+			continue;
+		}
+		//The class letter is the same as in the log
+		rec.dev_class = entry->dev_class;
+		rec.intf_classes = entry->intf_classes;
+		seq_printf(m, "%*s%u-%.*s %04X:%04X %c %s%s\n", 2 * (entry->level + 1), "", entry->busnum, USBLOG_DEVPATH_LEN,
+			entry->devpath, entry->vendor, entry->product, identify_record_class_type(&rec), usb_speed_string(entry->speed),
+			entry->flags & USBLOG_TOPO_HUB ? " hub" : "");
+	}
+
+	kvfree(entries);
+	return SUCCESS;
+}
+
+
+static int topo_proc_open(struct inode *inode, struct file *file){
+	try_module_get(THIS_MODULE);
+	return single_open(file, topo_proc_show, NULL);
+}
+
+
+static int topo_proc_release(struct inode *inode, struct file *file){
+	module_put(THIS_MODULE);
+	return single_release(inode, file);
+}
+
+
+//debugfs/usblogger/perf shows the count, mean and maximum of each hot path and its non-empty histogram buckets
+//A bucket is printed as its lower bound in nanoseconds
+static int perf_debugfs_show(struct seq_file *m, void *v){
+	struct usblog_perf_stats *stats;
+	struct usblog_perf_hist *hist;
+	int path, i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if(!stats)
+		return -ENOMEM;
+	log_perf_fill(stats);
+
+	seq_printf(m, "dropped=%llu overruns=%llu untracked=%llu nl_dropped=%llu\n", stats->dropped, stats->overruns,
+		stats->untracked, stats->nl_dropped);
+	for(path=0; path<USBLOG_PERF_NR; path++){
+		hist = &stats->paths[path];
+		seq_printf(m, "%s: count=%llu mean=%lluns max=%lluns\n", log_perf_names[path], hist->count,
+			hist->count ? div64_u64(hist->sum, hist->count) : 0, hist->max);
+		for(i=0; i<USBLOG_PERF_BUCKETS; i++)
+			if(hist->buckets[i])
+				seq_printf(m, "\t%llu: %llu\n", i ? 1ULL << i : 0, hist->buckets[i]);
+	}
+
+	kfree(stats);
+	return SUCCESS;
+}
+
+
+static int perf_debugfs_open(struct inode *inode, struct file *file){
+	return single_open(file, perf_debugfs_show, NULL);
+}
+
+
+//Writing anything to debugfs/usblogger/reset starts the histograms from zero
+static ssize_t perf_debugfs_reset(struct file *file, const char __user *buffer, size_t length, loff_t *off){
+	log_perf_reset();
+	return length;
+}
+
+
+
+
+//This function calls on demand of read request from seq_files
+static int dev_proc_show(struct seq_file *m, void *v){
+	struct usblog_ruleset *set;
+	struct usblog_rule *rule;
+	unsigned int i = 0;
+	int bkt;
+
+	//Readers only walk the hash table under RCU, so they never block the writers or usb_notify
+	rcu_read_lock();
+	set = rcu_dereference(blocklist);
+	hash_for_each_rcu(set->table, bkt, rule, node){
+		seq_printf(m, "%u: %04X:%04X ", i++, rule->spec.vendor, rule->spec.product);
+		if(rule->spec.flags & USBLOG_RULE_CLASS)
+			seq_printf(m, "%02X", rule->spec.dev_class);
+		else
+			seq_puts(m, "*");
+		if(rule->spec.flags & USBLOG_RULE_SERIAL)
+			seq_printf(m, " %.*s", USBLOG_SERIAL_LEN, rule->spec.serial);
+		seq_printf(m, " hits=%llu\n", blocklist_rule_hits(rule));
+	}
+	rcu_read_unlock();
+
+	return SUCCESS;
+}
+
+
+//Each time user try to echo something or otherwise write anything to the /dev entry, this function does the job
+//Every line is one rule as blocklist_parse_rule expects, and a leading '-' removes the rule instead
+//A binary struct usblog_rule_batch replaces the whole blocklist in one write instead
+static ssize_t dev_proc_write(struct file *file, const char __user *buffer, size_t length, loff_t * off){
+	struct usblog_rule_spec spec;
+	char *text, *cursor, *line;
+	unsigned int rules = 0;
+	bool remove;
+	int err = SUCCESS;
+	u64 start;
+	u32 magic;
+
+	if(length >= sizeof(struct usblog_rule_batch) && !get_user(magic, (u32 __user *) buffer) && magic == USBLOG_BATCH_MAGIC){
+		err = dev_load_batch(buffer, length, NULL);
+		return err ? err : length;
+	}
+
+	if(length >= PAGE_SIZE)
+		return -EINVAL;
+
+	//Copy the text before taking the writers' mutex, a fault in userspace could never leave it locked
+	text = memdup_user_nul(buffer, length);
+	if(IS_ERR(text))
+		return PTR_ERR(text);
+
+	cursor = text;
+	start = log_perf_start(false);
+	mutex_lock(&blocklist_mutex);
+	log_perf_end(USBLOG_PERF_BLOCKLIST_LOCK, start);
+	start = trace_usblogger_blocklist_write_enabled() ? ktime_get_ns() : 0;
+	while((line = strsep(&cursor, "\n")) != NULL){
+		line = strim(line);
+		if(!*line)
+			continue;
+		remove = (*line == '-');
+		err = blocklist_parse_rule(remove ? line + 1 : line, &spec);
+		if(!err)
+			err = remove ? blocklist_del(&spec) : blocklist_add(&spec);
+		if(err)
+			break;
+		rules++;
+	}
+	trace_usblogger_blocklist_write(rules, err, start ? ktime_get_ns() - start : 0);
+	mutex_unlock(&blocklist_mutex);
+	kfree(text);
+
+	//The function returns wrote charachters count
+	return err ? err : length;
+}
+
+
+//This is where system functionallity triggers every time some process try to read from our proc entry
+static int dev_proc_open(struct inode *inode, struct file *file){
+	//There is no open exclusion, any number of readers could take their own snapshot at the same time
+	//Eachtime you open the entry point, infact you are using the device, so you have to
+	//count the references to it, in order to when you want to release it, you could safely release
+	//the device with reference count of zero
+	//So we increase the reference count using try_module_get
+	try_module_get(THIS_MODULE);
+	//And now we will process the request
+	return single_open(file, dev_proc_show, NULL);
+}
+
+
+//Each time you release the /dev entry after read or write somthing from and to /dev entry
+//This function have to adjust the reference count and does its job
+static int dev_proc_release(struct inode *inode, struct file *file){
+	//When you release the entry point, that means you have finished with the device so
+	//decrese the reference count wit module_put
+	module_put(THIS_MODULE);
+	//And finally release the file
+	return single_release(inode, file);
+}
+
+
+
+
+//Fill the device fields of a record straight from struct usb_device, nothing is allocated here
+static void log_fill_device(struct usblog_record *event, struct usb_device *usbdev){
+	struct usb_host_config *config = usbdev->actconfig;
+	u8 intf_class;
+	int i;
+
+	event->vendor = le16_to_cpu(usbdev->descriptor.idVendor);
+	event->product = le16_to_cpu(usbdev->descriptor.idProduct);
+	event->dev_class = usbdev->descriptor.bDeviceClass;
+	event->speed = usbdev->speed;
+	event->busnum = usbdev->bus->busnum;
+	event->devnum = usbdev->devnum;
+	strncpy(event->devpath, usbdev->devpath, USBLOG_DEVPATH_LEN);
+	if(usbdev->serial)
+		event->serial_hash = jhash(usbdev->serial, strlen(usbdev->serial), 0);
+
+	//The interfaces of the active configuration, for a device of class 0 these are the only classes it has
+	for(i=0; config && i<config->desc.bNumInterfaces; i++){
+		if(!config->interface[i] || !config->interface[i]->cur_altsetting)
+			continue;
+		intf_class = config->interface[i]->cur_altsetting->desc.bInterfaceClass;
+		event->intf_classes |= BIT(min_t(u8, intf_class, USBLOG_INTF_OTHER));
+	}
+}
+
+
+static int usb_notify(struct notifier_block *self, unsigned long action, void *dev){
+	u64 start = log_perf_start(trace_usblogger_capture_enabled());
+	struct usblog_record event = {0};
+	struct usb_device *usbdev = NULL;
+	struct usblog_device *device = NULL;
+
+	if(!dev){
+		this_cpu_inc(log_counters.dropped);
+		return NOTIFY_DONE;
+	}
+
+	//Decide on different actions
+	//Bus notifications pass a usb_bus structure, so only device notifications carry descriptors
+	switch(action){
+		case USB_DEVICE_ADD:
+			event.action = USBLOG_ACTION_DEVICE_ADD;
+			break;
+		case USB_DEVICE_REMOVE:
+			event.action = USBLOG_ACTION_DEVICE_REMOVE;
+			break;
+		case USB_BUS_ADD:
+			event.action = USBLOG_ACTION_BUS_ADD;
+			break;
+		case USB_BUS_REMOVE:
+			event.action = USBLOG_ACTION_BUS_REMOVE;
+			break;
+		default:
+			return NOTIFY_DONE;
+	}
+
+	if(action == USB_DEVICE_ADD || action == USB_DEVICE_REMOVE){
+		usbdev = (struct usb_device *) dev;
+		//This has to happen before the blocklist could drop the configuration and its interfaces
+		log_fill_device(&event, usbdev);
+		//usb_disconnect has already dropped the configuration, so the interfaces are only known from the add
+		if(action == USB_DEVICE_REMOVE && !event.intf_classes)
+			event.intf_classes = topo_intf_classes(usbdev);
+	}
+	else
+		event.busnum = ((struct usb_bus *) dev)->busnum;
+	//Only a raw 64-bit boot time is taken here, it keeps counting across suspend and never goes backwards
+	event.timestamp = ktime_get_boot_ns();
+
+	//The live topology follows every bus and device, so what is attached is known without a sysfs walk
+	topo_update(action, dev, &event);
+
+	//Keep the aggregates of the device up to date, so nobody has to scan the log for them
+	if(usbdev)
+		device = device_update(&event);
+
+	//Check the blocklist and store the record in the ring of this CPU, or fold it into the storm of the device
+	log_capture(&event, usbdev, device, start);
+	log_perf_end(USBLOG_PERF_NOTIFY, start);
+
+	//Printing and waking up the readers is left to the work, queueing it again while it is pending costs nothing
+	queue_work(log_wq, &log_work);
+
+	return NOTIFY_OK;
+}
+
+
+
+//Using notifiers for identifying actions on usb
+static struct notifier_block usb_nb = {
+	.notifier_call = usb_notify, //This fuction will call whenever the notifier triggers
+};
+
+
+//Struct file_operations is the key to the functionality of the module
+//functions that defined here are going to add to the kernel functionallity
+//in order to respond to userspace access demand to the correspond /proc entry
+static const struct file_operations log_fops = {
+	.owner = THIS_MODULE,
+	.open = log_proc_open,
+	.read = log_proc_read,
+	.llseek = log_proc_llseek,
+	.release = log_proc_release,
+	.mmap = log_proc_mmap,
+	.unlocked_ioctl = log_proc_ioctl, //This fuction will call whenever the ioctl command recieved from the user
+};
+
+static const struct file_operations stream_fops = {
+	.owner = THIS_MODULE,
+	.open = stream_proc_open,
+	.read = stream_proc_read,
+	.poll = stream_proc_poll,
+	.llseek = stream_proc_llseek,
+	.release = stream_proc_release,
+};
+
+static const struct file_operations devstats_fops = {
+	.owner = THIS_MODULE,
+	.open = devstats_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = devstats_proc_release,
+};
+
+static const struct file_operations topo_fops = {
+	.owner = THIS_MODULE,
+	.open = topo_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = topo_proc_release,
+};
+
+static const struct file_operations perf_fops = {
+	.owner = THIS_MODULE,
+	.open = perf_debugfs_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations perf_reset_fops = {
+	.owner = THIS_MODULE,
+	.write = perf_debugfs_reset,
+};
+
+static const struct file_operations dev_fops = {
+	.owner = THIS_MODULE,
+	.open = dev_proc_open,
+	.read = seq_read,
+	.write = dev_proc_write,
+	.llseek = seq_lseek,
+	.release = dev_proc_release,
+	.unlocked_ioctl = dev_proc_ioctl, //This fuction will call whenever the ioctl command recieved from the user
+};
+
+
+
+#ifdef USBLOGGER_KUNIT
+//The suite only calls what works on its own arguments, the live log is never touched
+void log_test_fill_device(struct usblog_record *event, struct usb_device *usbdev){
+	log_fill_device(event, usbdev);
+}
+#endif
+
+
+//You sould clean up the mess before exiting the module
+static void usb_logger_exit(void){
+	//First, the notifier as the main function call should be unregistered
+	usb_unregister_notify(&usb_nb);
+	//Then nobody could queue the work anymore, so run it one last time for the records which are still in the rings
+	//and only then write out the journal, otherwise the last events before an unload or a shutdown would be lost
+	if(log_wq){
+		//A pending storm is the only copy of the events it has folded, so every storm is stored before the last run
+		cancel_delayed_work_sync(&coalesce_work);
+		coalesce_store(true);
+		if(log_work_batch){
+			queue_work(log_wq, &log_work);
+			flush_work(&log_work);
+		}
+		journal_close();
+		destroy_workqueue(log_wq);
+		log_wq = NULL;
+	}
+	//The log work was the only one which multicasts, so the family could go now
+	if(log_genl_registered){
+		genl_unregister_family(&log_genl_family);
+		log_genl_registered = false;
+	}
+	kfree(log_work_batch);
+	log_work_batch = NULL;
+	archive_free();
+	
+	//Second, We remove the proc and debugfs interfaces, so the users could not demand for this module's functionality
+	debugfs_remove_recursive(perf_debugfs_dir);
+	perf_debugfs_dir = NULL;
+
+	if(topo_proc_file)
+		remove_proc_entry("usbtopology", NULL);
+
+	if(devstats_proc_file)
+		remove_proc_entry("usbdevstats", NULL);
+
+	if(stream_proc_file)
+		remove_proc_entry("usblogger_events", NULL);
+
+	if(dev_proc_file)
+		remove_proc_entry("blockedusb", NULL);
+
+	if(log_proc_file)
+		remove_proc_entry(MODULE_NAME, NULL);	
+	//Third, it is time for other data structures to be unregistered
+	//Free the blocklist, there is no reader left after the notifier and the proc entries are gone
+	//Wait for the rules that were removed and are still waiting for their grace period too
+	rcu_barrier();
+	blocklist_free(rcu_dereference_protected(blocklist, 1));
+	RCU_INIT_POINTER(blocklist, NULL);
+	device_free();
+	topo_free();
+
+	if(log_header){
+		vfree(log_header);
+		log_header = NULL;
+	}
+
+	printk(KERN_INFO "USBLOGGER: %s module has been unregistered.\n", MODULE_NAME);
+	//The cleanup_module function doesn't need to return any value to the rest of the Kernel
+}
+
+
+//Your module's entry point
+static int usb_logger_init(void){
+	void *area;
+	int err;
+
+	//First we have to register some data structure that might be used by the module
+	//Registering and initialising an empty blocklist
+	RCU_INIT_POINTER(blocklist, blocklist_alloc());
+	if(!rcu_access_pointer(blocklist)){
+		printk(KERN_ALERT "USBLOGGER: Blocklist Registration Failure.\n");
+		usb_logger_exit();
+		return -ENOMEM;
+	}
+	
+	//Userspace tools and the journal depend on the layout of a record
+	BUILD_BUG_ON(sizeof(struct usblog_record) != 64);
+
+	//Now we have to preallocate the per-CPU rings for the log system
+	//Using a power of two capacity lets the writers find their slot with a simple mask
+	ring_size = roundup_pow_of_two(clamp(ring_size, 2U, 1U << 20));
+	//The header and the rings are allocated together, so they could be mapped to userspace as one area
+	area = vmalloc_user(log_ring_area_size(ring_size, nr_cpu_ids));
+	if(!area){
+		printk(KERN_ALERT "USBLOGGER: Event Ring Registration Failure.\n");
+		usb_logger_exit();
+		//Because of this fact that rings will obtain memory form system RAM, this error means the lack of enough memory
+		return -ENOMEM;
+	}
+	log_ring_setup(area, ring_size, nr_cpu_ids);
+	
+	//Registering a waitqueue
+	init_waitqueue_head(&our_queue);
+
+	//Registering the workqueue which reports the new records in batches
+	ratelimit_state_init(&log_ratelimit, 5 * HZ, kernel_log_burst);
+	log_work_batch = kmalloc_array(LOG_BATCH_LEN, sizeof(*log_work_batch), GFP_KERNEL);
+	log_wq = alloc_workqueue("usblogger", WQ_UNBOUND, 1);
+	//The compressor is only needed when compress_archive is set, but it could be turned on at any time
+	archive_wrkmem = kvmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+	archive_packbuf = kvmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+	if(!log_work_batch || !log_wq || !archive_wrkmem || !archive_packbuf){
+		printk(KERN_ALERT "USBLOGGER: Workqueue Registration Failure.\n");
+		usb_logger_exit();
+		return -ENOMEM;
+	}
+
+	//Bring back the records of the journal before any new event could arrive
+	journal_open();
+	
+	
+	//Then, we should register the interfaces and notifier
+	log_proc_file = proc_create(MODULE_NAME, 0644 , NULL, &log_fops);
+	//Put an error message in kernel log if cannot create proc entry
+	if(!log_proc_file){
+		printk(KERN_ALERT "USBLOGGER: Proc File Registration Failure.\n");
+		usb_logger_exit();
+		//Because of this fact that procfs is a RAM filesystem, this error means the lack of enough memory
+		return -ENOMEM;
+	}
+
+
+	dev_proc_file = proc_create("blockedusb", 0644 , NULL, &dev_fops);
+	//Put an error message in kernel log if cannot create proc entry
+	if(!dev_proc_file){
+		printk(KERN_ALERT "USBLOGGER: Proc File Registration failure.\n");
+		usb_logger_exit();
+		//Because of this fact that procfs is a ram filesystem, this error means the lack of enough memory
+		return -ENOMEM;
+	}
+
+	stream_proc_file = proc_create("usblogger_events", 0444 , NULL, &stream_fops);
+	//Put an error message in kernel log if cannot create proc entry
+	if(!stream_proc_file){
+		printk(KERN_ALERT "USBLOGGER: Proc File Registration failure.\n");
+		usb_logger_exit();
+		return -ENOMEM;
+	}
+
+	devstats_proc_file = proc_create("usbdevstats", 0444 , NULL, &devstats_fops);
+	//Put an error message in kernel log if cannot create proc entry
+	if(!devstats_proc_file){
+		printk(KERN_ALERT "USBLOGGER: Proc File Registration failure.\n");
+		usb_logger_exit();
+		return -ENOMEM;
+	}
+
+	topo_proc_file = proc_create("usbtopology", 0444 , NULL, &topo_fops);
+	//Put an error message in kernel log if cannot create proc entry
+	if(!topo_proc_file){
+		printk(KERN_ALERT "USBLOGGER: Proc File Registration failure.\n");
+		usb_logger_exit();
+		return -ENOMEM;
+	}
+
+	//The histograms are only for looking at, so the module works without debugfs too
+	perf_debugfs_dir = debugfs_create_dir(MODULE_NAME, NULL);
+	if(!IS_ERR_OR_NULL(perf_debugfs_dir)){
+		debugfs_create_file("perf", 0444, perf_debugfs_dir, NULL, &perf_fops);
+		debugfs_create_file("reset", 0200, perf_debugfs_dir, NULL, &perf_reset_fops);
+	}
+
+	//The Generic Netlink family for the subscribers
+	err = genl_register_family(&log_genl_family);
+	if(err){
+		printk(KERN_ALERT "USBLOGGER: Generic Netlink Registration failure.\n");
+		usb_logger_exit();
+		return err;
+	}
+	log_genl_registered = true;
+	
+				
+	//At last it is time to register our notifier
+	usb_register_notify(&usb_nb);
+	//Only then the topology is seeded with what is already there, so nothing could be missed in between
+	usb_for_each_dev(NULL, topo_seed_device);
+
+	//Notify the user in the Kernel log of the module successful initialisation
+	printk(KERN_INFO "USBLOGGER: %s module has been registered.\n", MODULE_NAME);
+	
+	//The init_module should return a value to the rest of kernel that asure
+	//them to its successfully registration of its functionality
+	return SUCCESS;
+}
+
+
+//Now we need to define init-module and cleanup_module aliases
+module_init(usb_logger_init);
+module_exit(usb_logger_exit);
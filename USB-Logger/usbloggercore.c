@@ -0,0 +1,916 @@
+//The storage core of the logger, see usbloggercore.h
+//Nothing in here may use a kernel interface which is not in usbloggershim.h, so it builds in userspace too
+#include "usbloggercore.h"
+
+#ifndef __KERNEL__
+//The CPU which the current thread plays and the number of them, see usbloggershim.h
+__thread int usblog_shim_cpu;
+int usblog_shim_nr_cpus = 1;
+#endif
+
+struct usblog_ruleset __rcu *blocklist;
+DEFINE_MUTEX(blocklist_mutex);
+unsigned int blocklist_size = 4096;
+
+struct usblog_ring_header *log_header;
+struct usblog_record *log_records;
+size_t log_area_size;
+unsigned int ring_mask;
+atomic64_t *log_sequence;
+
+
+//This function will distinguish between various device classes
+char identify_device_class_type(__u8 device_class){
+	switch(device_class){
+		case USB_CLASS_AUDIO:
+			return 'A';
+			break;
+		case USB_CLASS_COMM:
+			return 'C';
+			break;
+		case USB_CLASS_HID:
+			return 'D';
+			break;
+		case USB_CLASS_PRINTER:
+			return 'P';
+			break;
+		case USB_CLASS_HUB:
+			return 'H';
+			break;
+		case USB_CLASS_VIDEO:
+			return 'V';
+			break;
+		case USB_CLASS_MASS_STORAGE:
+			return 'S';
+			break;
+		case USB_CLASS_WIRELESS_CONTROLLER:
+			return 'W';
+			break;
+		default:
+			return 'N';
+		}
+}
+
+
+//Devices with a class per interface are shown with the class of their first interface
+char identify_record_class_type(const struct usblog_record *rec){
+	if(rec->dev_class == USB_CLASS_PER_INTERFACE && rec->intf_classes && !(rec->intf_classes & BIT(USBLOG_INTF_OTHER)))
+		return identify_device_class_type(__ffs(rec->intf_classes));
+	return identify_device_class_type(rec->dev_class);
+}
+
+
+//Whether a record is of a class, a device of class 0 is of the classes of its interfaces too
+//Classes above 30 share the last bit of intf_classes, so for them any such interface is enough
+bool log_record_has_class(const struct usblog_record *rec, __u8 dev_class){
+	if(rec->dev_class == dev_class)
+		return true;
+	return rec->dev_class == USB_CLASS_PER_INTERFACE && (rec->intf_classes & BIT(min_t(u8, dev_class, USBLOG_INTF_OTHER)));
+}
+
+
+//Convert a stored action to the short code that we print
+const char *log_action_name(__u8 action){
+	switch(action){
+		case USBLOG_ACTION_DEVICE_ADD:
+			return "DA";
+		case USBLOG_ACTION_DEVICE_REMOVE:
+			return "DR";
+		case USBLOG_ACTION_BUS_ADD:
+			return "BA";
+		case USBLOG_ACTION_BUS_REMOVE:
+			return "BR";
+		default:
+			return "??";
+	}
+}
+
+
+//Blocklist decisions (or flapping) are printed after the time
+const char *log_flags_name(__u8 flags){
+	if(flags & USBLOG_FLAG_REJECTED)
+		return " rejected";
+	if(flags & USBLOG_FLAG_BLOCKED)
+		return " blocked";
+	if(flags & USBLOG_FLAG_FLAPPING)
+		return " flapping";
+	return "";
+}
+
+
+//Size of the area for nr_rings rings of size records each, the rings start on the page after the header
+size_t log_ring_area_size(unsigned int size, unsigned int nr_rings){
+	size_t data_offset = PAGE_ALIGN(sizeof(struct usblog_ring_header) + nr_rings * sizeof(struct usblog_ring_head));
+
+	return data_offset + (size_t) nr_rings * size * sizeof(struct usblog_record);
+}
+
+
+//Fill the header of a zeroed area and make it the current log
+void log_ring_setup(void *area, unsigned int size, unsigned int nr_rings){
+	log_header = area;
+	log_area_size = log_ring_area_size(size, nr_rings);
+	ring_mask = size - 1;
+	log_header->magic = USBLOG_RING_MAGIC;
+	log_header->version = USBLOG_RING_VERSION;
+	log_header->nr_rings = nr_rings;
+	log_header->ring_size = size;
+	log_header->record_size = sizeof(struct usblog_record);
+	log_header->data_offset = log_area_size - (size_t) nr_rings * size * sizeof(struct usblog_record);
+	log_records = (struct usblog_record *) ((char *) log_header + log_header->data_offset);
+	log_sequence = (atomic64_t *) &log_header->head_seq;
+}
+
+
+//Find the record slot of a ring position
+static struct usblog_record *log_ring_slot(int cpu, u64 pos){
+	return &log_records[(size_t) cpu * (ring_mask + 1) + (pos & ring_mask)];
+}
+
+
+//Append one record to the ring of the current CPU
+//Preemption is disabled while we are writing, so each ring has exactly one writer at a time
+void log_ring_store(struct usblog_record *event){
+	int cpu = get_cpu();
+	u64 head = log_header->heads[cpu].head;
+	struct usblog_record *slot = log_ring_slot(cpu, head);
+	u64 seq;
+
+	//Tell the readers that a sequence number is in flight on this ring
+	//atomic64_inc_return is a full barrier, so busy is visible before our sequence number
+	WRITE_ONCE(log_header->heads[cpu].busy, 1);
+	seq = atomic64_inc_return(log_sequence);
+
+	//Readers check the sequence before and after copying a slot, so first mark it as empty
+	WRITE_ONCE(slot->seq, 0);
+	smp_wmb();
+	event->seq = seq;
+	memcpy((char *) slot + sizeof(slot->seq), (char *) event + sizeof(event->seq), sizeof(*slot) - sizeof(slot->seq));
+	smp_wmb();
+	WRITE_ONCE(slot->seq, seq);
+	//Publish the new head only after the slot is complete
+	smp_wmb();
+	WRITE_ONCE(log_header->heads[cpu].head, head + 1);
+	smp_wmb();
+	WRITE_ONCE(log_header->heads[cpu].busy, 0);
+	put_cpu();
+}
+
+
+//Read the head of a ring, the records before it are complete
+static u64 log_ring_head(int cpu){
+	u64 head = READ_ONCE(log_header->heads[cpu].head);
+
+	smp_rmb();
+	return head;
+}
+
+
+//Return the latest sequence number for which every record is already published (or overwritten)
+//Writers keep preemption disabled while they are busy, so we only have to wait a few instructions
+u64 log_ring_stable_seq(void){
+	u64 seq = atomic64_read(log_sequence);
+	u64 head;
+	int cpu;
+
+	smp_mb();
+	for_each_possible_cpu(cpu){
+		head = READ_ONCE(log_header->heads[cpu].head);
+		while(READ_ONCE(log_header->heads[cpu].busy) && READ_ONCE(log_header->heads[cpu].head) == head)
+			cpu_relax();
+	}
+	smp_rmb();
+	return seq;
+}
+
+
+//Take a stable copy of one slot, returns false if a writer was changing it meanwhile
+static bool log_ring_read_slot(int cpu, u64 pos, struct usblog_record *out){
+	struct usblog_record *slot = log_ring_slot(cpu, pos);
+	u64 seq = READ_ONCE(slot->seq);
+
+	smp_rmb();
+	*out = *slot;
+	smp_rmb();
+	return seq != 0 && out->seq == seq && READ_ONCE(slot->seq) == seq;
+}
+
+
+//Oldest position that still holds a record on this ring
+static u64 log_ring_tail(u64 head){
+	return head > ring_mask ? head - ring_mask - 1 : 0;
+}
+
+
+//Find the first position on a ring with a sequence number equal or greater than from_seq
+//Records of one ring are always in sequence order, so a binary search is enough
+static u64 log_ring_seek(int cpu, u64 lo, u64 hi, u64 from_seq){
+	struct usblog_record rec;
+	u64 mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		//A slot that is being rewritten holds a newer record, so it is never too old
+		if(log_ring_read_slot(cpu, mid, &rec) && rec.seq < from_seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+//Merge all per-CPU rings by sequence number and copy up to max records between from_seq and last_seq
+//It never takes a lock, so it is safe to call while usb_notify is appending new records
+//last_seq should come from log_ring_stable_seq, then no record in the range could show up later
+//Returns the number of records copied, or a negative error code
+int log_ring_collect(u64 from_seq, u64 last_seq, struct usblog_record *out, unsigned int max){
+	struct log_ring_cursor{
+		u64 pos, end;
+		struct usblog_record rec;
+		bool valid;
+	} *cursors;
+	unsigned int count = 0;
+	int cpu, best;
+
+	cursors = kcalloc(nr_cpu_ids, sizeof(*cursors), GFP_KERNEL);
+	if(!cursors)
+		return -ENOMEM;
+
+	//Records before the tail have been discarded by a reset
+	from_seq = max_t(u64, from_seq, READ_ONCE(log_header->tail_seq));
+
+	//Position each CPU's cursor at its first interesting record
+	for_each_possible_cpu(cpu){
+		cursors[cpu].end = log_ring_head(cpu);
+		cursors[cpu].pos = log_ring_seek(cpu, log_ring_tail(cursors[cpu].end), cursors[cpu].end, from_seq);
+	}
+
+	while(count < max){
+		best = -1;
+		for_each_possible_cpu(cpu){
+			//Refill the cursor, skipping the slots that have been overwritten under our feet
+			while(!cursors[cpu].valid && cursors[cpu].pos < cursors[cpu].end){
+				if(cursors[cpu].pos < log_ring_tail(log_ring_head(cpu)))
+					cursors[cpu].pos = log_ring_tail(log_ring_head(cpu));
+				if(log_ring_read_slot(cpu, cursors[cpu].pos, &cursors[cpu].rec) && cursors[cpu].rec.seq >= from_seq
+					&& cursors[cpu].rec.seq <= last_seq)
+					cursors[cpu].valid = true;
+				//Records of a ring are in order, so nothing after this one could be in range
+				else if(cursors[cpu].rec.seq > last_seq)
+					cursors[cpu].end = cursors[cpu].pos;
+				else
+					cursors[cpu].pos++;
+			}
+			if(cursors[cpu].valid && (best < 0 || cursors[cpu].rec.seq < cursors[best].rec.seq))
+				best = cpu;
+		}
+		if(best < 0)
+			break;
+		out[count++] = cursors[best].rec;
+		cursors[best].valid = false;
+		cursors[best].pos++;
+	}
+
+	kfree(cursors);
+	return count;
+}
+
+
+//Number of records which are currently held in all rings from from_seq on
+unsigned long log_ring_count(u64 from_seq){
+	unsigned long count = 0;
+	u64 head;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		head = log_ring_head(cpu);
+		count += head - log_ring_seek(cpu, log_ring_tail(head), head, from_seq);
+	}
+	return count;
+}
+
+
+//Sequence number of the oldest record which is still held in any ring, or the next one if they are all empty
+u64 log_ring_oldest_seq(void){
+	u64 oldest = atomic64_read(log_sequence) + 1, head, pos;
+	struct usblog_record rec;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		head = log_ring_head(cpu);
+		//A slot that is being rewritten holds a newer record, the next one is then the oldest
+		for(pos=log_ring_tail(head); pos<head; pos++){
+			if(log_ring_read_slot(cpu, pos, &rec)){
+				oldest = min(oldest, rec.seq);
+				break;
+			}
+		}
+	}
+	return oldest;
+}
+
+
+//Total capacity of all rings together
+unsigned long log_ring_capacity(void){
+	return (unsigned long) (ring_mask + 1) * num_possible_cpus();
+}
+
+
+//The first byte of a packed record, the action takes the low bits unless it does not fit there
+#define PACK_ACTION		0x07
+#define PACK_LITERAL		0x08	//The device fields follow, otherwise they are in the dictionary
+#define PACK_INDEX		0x70	//Slot of the dictionary when the device is not literal
+#define PACK_INDEX_SHIFT	4
+#define PACK_EXTRA		0x80	//A varint follows with the flags and which of the rare fields are there
+//The bits of that varint, the flags of the record are above them
+#define PACK_X_SEQ		0x01	//The sequence number is not the next one, its delta follows
+#define PACK_X_REPEATS		0x02	//The record has been coalesced, repeats and first_ts follow
+#define PACK_X_RESERVED		0x04
+#define PACK_X_FLAGS_SHIFT	3
+
+
+static u8 *log_pack_varint(u8 *p, u64 value){
+	while(value >= 0x80){
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+
+static bool log_unpack_varint(const u8 *block, size_t len, size_t *pos, u64 *value){
+	unsigned int shift;
+
+	*value = 0;
+	for(shift=0; shift<64 && *pos<len; shift += 7){
+		*value |= (u64) (block[*pos] & 0x7f) << shift;
+		if(!(block[(*pos)++] & 0x80))
+			return true;
+	}
+	return false;
+}
+
+
+//Timestamps of records from different CPUs could go a little backwards, so the deltas are signed
+static u64 log_pack_zigzag(u64 delta){
+	return (delta << 1) ^ (u64) ((s64) delta >> 63);
+}
+
+
+static u64 log_unpack_zigzag(u64 value){
+	return (value >> 1) ^ -(value & 1);
+}
+
+
+static u8 *log_pack_le(u8 *p, u32 value, unsigned int bytes){
+	while(bytes--){
+		*p++ = value;
+		value >>= 8;
+	}
+	return p;
+}
+
+
+static bool log_unpack_le(const u8 *block, size_t len, size_t *pos, u32 *value, unsigned int bytes){
+	unsigned int i;
+
+	if(len - *pos < bytes)
+		return false;
+	*value = 0;
+	for(i=0; i<bytes; i++)
+		*value |= (u32) block[(*pos)++] << (8 * i);
+	return true;
+}
+
+
+//The device fields of a record, zeroed first so two of them could be compared with memcmp
+static void log_pack_device(const struct usblog_record *rec, struct usblog_pack_device *dev){
+	memset(dev, 0, sizeof(*dev));
+	dev->vendor = rec->vendor;
+	dev->product = rec->product;
+	dev->busnum = rec->busnum;
+	dev->dev_class = rec->dev_class;
+	dev->speed = rec->speed;
+	dev->devnum = rec->devnum;
+	dev->serial_hash = rec->serial_hash;
+	dev->intf_classes = rec->intf_classes;
+	memcpy(dev->devpath, rec->devpath, strnlen(rec->devpath, USBLOG_DEVPATH_LEN));
+}
+
+
+//A literal device replaces the oldest one of the dictionary, the packing and the decoding do the same
+static void log_pack_remember(struct usblog_packer *packer, const struct usblog_pack_device *dev){
+	packer->dict[packer->next] = *dev;
+	packer->next = (packer->next + 1) % USBLOG_PACK_DICT;
+	packer->used = max(packer->used, packer->next ? packer->next : USBLOG_PACK_DICT);
+}
+
+
+//Start a new block
+void log_pack_init(struct usblog_packer *packer){
+	memset(packer, 0, sizeof(*packer));
+}
+
+
+//Append one record to the block, which has len bytes in use out of room
+//Returns false without touching the block or the packer if the record does not fit anymore
+bool log_pack_record(struct usblog_packer *packer, const struct usblog_record *rec, u8 *block, size_t *len, size_t room){
+	struct usblog_pack_device dev;
+	u8 buf[USBLOG_PACK_MAX], *p = buf + 1;
+	unsigned int slot, pathlen;
+	u64 extra;
+
+	log_pack_device(rec, &dev);
+	for(slot=0; slot<packer->used; slot++)
+		if(!memcmp(&packer->dict[slot], &dev, sizeof(dev)))
+			break;
+	buf[0] = min_t(u8, rec->action, PACK_ACTION);
+	buf[0] |= slot < packer->used ? slot << PACK_INDEX_SHIFT : PACK_LITERAL;
+
+	extra = (u64) rec->flags << PACK_X_FLAGS_SHIFT;
+	if(rec->seq != packer->seq + 1)
+		extra |= PACK_X_SEQ;
+	if(rec->repeats || rec->first_ts)
+		extra |= PACK_X_REPEATS;
+	if(rec->reserved)
+		extra |= PACK_X_RESERVED;
+	if(extra){
+		buf[0] |= PACK_EXTRA;
+		p = log_pack_varint(p, extra);
+	}
+	if(extra & PACK_X_SEQ)
+		p = log_pack_varint(p, rec->seq - packer->seq);
+	if(rec->action >= PACK_ACTION)
+		*p++ = rec->action;
+	if(extra & PACK_X_RESERVED)
+		*p++ = rec->reserved;
+	p = log_pack_varint(p, log_pack_zigzag(rec->timestamp - packer->timestamp));
+
+	if(buf[0] & PACK_LITERAL){
+		p = log_pack_le(p, dev.vendor, 2);
+		p = log_pack_le(p, dev.product, 2);
+		*p++ = dev.dev_class;
+		*p++ = dev.speed;
+		*p++ = dev.devnum;
+		p = log_pack_varint(p, dev.busnum);
+		p = log_pack_le(p, dev.serial_hash, 4);
+		p = log_pack_varint(p, dev.intf_classes);
+		pathlen = strnlen(dev.devpath, USBLOG_DEVPATH_LEN);
+		*p++ = pathlen;
+		memcpy(p, dev.devpath, pathlen);
+		p += pathlen;
+	}
+	if(extra & PACK_X_REPEATS){
+		p = log_pack_varint(p, rec->repeats);
+		p = log_pack_varint(p, log_pack_zigzag(rec->timestamp - rec->first_ts));
+	}
+
+	if(*len > room || room - *len < (size_t) (p - buf))
+		return false;
+	memcpy(block + *len, buf, p - buf);
+	*len += p - buf;
+	packer->seq = rec->seq;
+	packer->timestamp = rec->timestamp;
+	if(buf[0] & PACK_LITERAL)
+		log_pack_remember(packer, &dev);
+	return true;
+}
+
+
+//Decode the record at pos and move pos past it, this is only done on the read path
+//Returns false at the end of the block, or if the data is not a valid record
+bool log_unpack_record(struct usblog_packer *packer, const u8 *block, size_t len, size_t *pos, struct usblog_record *rec){
+	struct usblog_pack_device dev;
+	u64 extra = 0, delta = 1, value;
+	size_t p = *pos;
+	u32 field;
+	u8 header;
+
+	if(p >= len)
+		return false;
+	header = block[p++];
+	memset(rec, 0, sizeof(*rec));
+	if((header & PACK_EXTRA) && (!log_unpack_varint(block, len, &p, &extra) || (extra >> PACK_X_FLAGS_SHIFT) > 0xff))
+		return false;
+	if((extra & PACK_X_SEQ) && !log_unpack_varint(block, len, &p, &delta))
+		return false;
+	rec->action = header & PACK_ACTION;
+	if(rec->action == PACK_ACTION && (p >= len || (rec->action = block[p++]) < PACK_ACTION))
+		return false;
+	if((extra & PACK_X_RESERVED) && (p >= len || !(rec->reserved = block[p++])))
+		return false;
+	if(!log_unpack_varint(block, len, &p, &value))
+		return false;
+	rec->timestamp = packer->timestamp + log_unpack_zigzag(value);
+
+	if(header & PACK_LITERAL){
+		memset(&dev, 0, sizeof(dev));
+		if(!log_unpack_le(block, len, &p, &field, 2))
+			return false;
+		dev.vendor = field;
+		if(!log_unpack_le(block, len, &p, &field, 2) || len - p < 3)
+			return false;
+		dev.product = field;
+		dev.dev_class = block[p++];
+		dev.speed = block[p++];
+		dev.devnum = block[p++];
+		if(!log_unpack_varint(block, len, &p, &value) || value > 0xffff)
+			return false;
+		dev.busnum = value;
+		if(!log_unpack_le(block, len, &p, &dev.serial_hash, 4))
+			return false;
+		if(!log_unpack_varint(block, len, &p, &value) || value > 0xffffffff || p >= len)
+			return false;
+		dev.intf_classes = value;
+		field = block[p++];
+		if(field > USBLOG_DEVPATH_LEN || len - p < field)
+			return false;
+		memcpy(dev.devpath, block + p, field);
+		p += field;
+	}
+	else if(((header & PACK_INDEX) >> PACK_INDEX_SHIFT) < packer->used)
+		dev = packer->dict[(header & PACK_INDEX) >> PACK_INDEX_SHIFT];
+	else
+		return false;
+
+	if(extra & PACK_X_REPEATS){
+		if(!log_unpack_varint(block, len, &p, &value) || value > 0xffffffff)
+			return false;
+		rec->repeats = value;
+		if(!log_unpack_varint(block, len, &p, &value))
+			return false;
+		rec->first_ts = rec->timestamp - log_unpack_zigzag(value);
+	}
+
+	rec->seq = packer->seq + delta;
+	rec->flags = extra >> PACK_X_FLAGS_SHIFT;
+	rec->vendor = dev.vendor;
+	rec->product = dev.product;
+	rec->busnum = dev.busnum;
+	rec->dev_class = dev.dev_class;
+	rec->speed = dev.speed;
+	rec->devnum = dev.devnum;
+	rec->serial_hash = dev.serial_hash;
+	rec->intf_classes = dev.intf_classes;
+	memcpy(rec->devpath, dev.devpath, USBLOG_DEVPATH_LEN);
+
+	packer->seq = rec->seq;
+	packer->timestamp = rec->timestamp;
+	if(header & PACK_LITERAL)
+		log_pack_remember(packer, &dev);
+	*pos = p;
+	return true;
+}
+
+
+//Move a record of an earlier boot to the boot time of this one, boot_delta is its boot_to_real minus ours
+//An earlier boot started earlier, so the record ends up with a negative boot time, the two's complement in timestamp
+//Everything which compares times reads them as signed, then replayed records sort before this boot's
+void log_replay_record(struct usblog_record *rec, s64 boot_delta){
+	rec->timestamp += boot_delta;
+	if(rec->first_ts)
+		rec->first_ts += boot_delta;
+	rec->flags |= USBLOG_FLAG_REPLAYED;
+}
+
+
+//Whether a record matches all the fields of a query
+bool log_query_match(const struct usblog_query *query, const struct usblog_record *rec){
+	return (!(query->match & USBLOG_QUERY_VENDOR) || rec->vendor == query->vendor)
+		&& (!(query->match & USBLOG_QUERY_PRODUCT) || rec->product == query->product)
+		&& (!(query->match & USBLOG_QUERY_CLASS) || log_record_has_class(rec, query->dev_class))
+		&& (!(query->match & USBLOG_QUERY_ACTION) || rec->action == query->action)
+		&& (!(query->match & USBLOG_QUERY_SINCE) || (s64) rec->timestamp >= query->since)
+		&& (!(query->match & USBLOG_QUERY_UNTIL) || (s64) rec->timestamp <= query->until);
+}
+
+
+//Each key sets two bits of a bloom filter
+static void log_bloom_set(unsigned long *bloom, u32 key){
+	__set_bit(hash_32(key, ZONE_BLOOM_BITS), bloom);
+	__set_bit(hash_32(key ^ 0x9e3779b9, ZONE_BLOOM_BITS), bloom);
+}
+
+
+static bool log_bloom_test(const unsigned long *bloom, u32 key){
+	return test_bit(hash_32(key, ZONE_BLOOM_BITS), bloom) && test_bit(hash_32(key ^ 0x9e3779b9, ZONE_BLOOM_BITS), bloom);
+}
+
+
+//An empty zone, any time is outside of it
+void log_zone_init(struct usblog_zone *zone){
+	memset(zone, 0, sizeof(*zone));
+	zone->min_ts = S64_MAX;
+	zone->max_ts = S64_MIN;
+}
+
+
+//Add a record to the summary of its chunk
+void log_zone_add(struct usblog_zone *zone, const struct usblog_record *rec){
+	zone->min_ts = min(zone->min_ts, (s64) rec->timestamp);
+	zone->max_ts = max(zone->max_ts, (s64) rec->timestamp);
+	zone->actions |= BIT(rec->action & 31);
+	__set_bit(rec->dev_class, zone->classes);
+	if(rec->dev_class == USB_CLASS_PER_INTERFACE)
+		zone->intf_classes |= rec->intf_classes;
+	log_bloom_set(zone->vendors, rec->vendor);
+	log_bloom_set(zone->devices, ((u32) rec->vendor << 16) | rec->product);
+}
+
+
+//Whether a chunk could hold a record that matches the query, false means it surely does not
+bool log_zone_match(const struct usblog_zone *zone, const struct usblog_query *query){
+	if((query->match & USBLOG_QUERY_SINCE) && zone->max_ts < query->since)
+		return false;
+	if((query->match & USBLOG_QUERY_UNTIL) && zone->min_ts > query->until)
+		return false;
+	if((query->match & USBLOG_QUERY_ACTION) && !(zone->actions & BIT(query->action & 31)))
+		return false;
+	if((query->match & USBLOG_QUERY_CLASS) && !test_bit(query->dev_class, zone->classes)
+		&& !(zone->intf_classes & BIT(min_t(u8, query->dev_class, USBLOG_INTF_OTHER))))
+		return false;
+	if((query->match & USBLOG_QUERY_VENDOR) && !log_bloom_test(zone->vendors, query->vendor))
+		return false;
+	if((query->match & (USBLOG_QUERY_VENDOR | USBLOG_QUERY_PRODUCT)) == (USBLOG_QUERY_VENDOR | USBLOG_QUERY_PRODUCT)
+		&& !log_bloom_test(zone->devices, ((u32) query->vendor << 16) | query->product))
+		return false;
+	return true;
+}
+
+
+//The hash key of a rule or a device
+static u32 blocklist_key(u16 vendor, u16 product){
+	return ((u32) vendor << 16) | product;
+}
+
+
+//Allocate an empty rule set
+struct usblog_ruleset *blocklist_alloc(void){
+	struct usblog_ruleset *set = kvzalloc(sizeof(*set), GFP_KERNEL);
+
+	if(set)
+		hash_init(set->table);
+	return set;
+}
+
+
+//Free one rule with its counters
+static void blocklist_free_rule(struct usblog_rule *rule){
+	free_percpu(rule->hits);
+	kfree(rule);
+}
+
+
+//Same as above, but called after an RCU grace period
+static void blocklist_free_rule_rcu(struct rcu_head *head){
+	blocklist_free_rule(container_of(head, struct usblog_rule, rcu));
+}
+
+
+//Free a rule set and all of its rules, nobody should be able to see it anymore
+void blocklist_free(struct usblog_ruleset *set){
+	struct usblog_rule *rule;
+	struct hlist_node *tmp;
+	int bkt;
+
+	if(!set)
+		return;
+	hash_for_each_safe(set->table, bkt, tmp, rule, node)
+		blocklist_free_rule(rule);
+	kvfree(set);
+}
+
+
+//Sum the hit counters of a rule over all CPUs
+u64 blocklist_rule_hits(struct usblog_rule *rule){
+	u64 hits = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hits += *per_cpu_ptr(rule->hits, cpu);
+	return hits;
+}
+
+
+//Two rules are the same if they match exactly the same devices
+static bool blocklist_same_rule(const struct usblog_rule_spec *a, const struct usblog_rule_spec *b){
+	if(a->vendor != b->vendor || a->product != b->product || a->flags != b->flags)
+		return false;
+	if((a->flags & USBLOG_RULE_CLASS) && a->dev_class != b->dev_class)
+		return false;
+	if((a->flags & USBLOG_RULE_SERIAL) && strncmp(a->serial, b->serial, USBLOG_SERIAL_LEN))
+		return false;
+	return true;
+}
+
+
+//Find a rule which is the same as spec, the caller should hold blocklist_mutex
+static struct usblog_rule *blocklist_find(struct usblog_ruleset *set, const struct usblog_rule_spec *spec){
+	struct usblog_rule *rule;
+
+	hash_for_each_possible(set->table, rule, node, blocklist_key(spec->vendor, spec->product))
+		if(blocklist_same_rule(&rule->spec, spec))
+			return rule;
+	return NULL;
+}
+
+
+//Check whether a device is blocked, this is O(1) and lock-free so usb_notify could call it
+//The caller should be inside rcu_read_lock
+struct usblog_rule *blocklist_match(const struct usblog_record *event, const char *serial){
+	struct usblog_ruleset *set = rcu_dereference(blocklist);
+	struct usblog_rule *rule;
+
+	hash_for_each_possible_rcu(set->table, rule, node, blocklist_key(event->vendor, event->product)){
+		if(rule->spec.vendor != event->vendor || rule->spec.product != event->product)
+			continue;
+		if((rule->spec.flags & USBLOG_RULE_CLASS) && !log_record_has_class(event, rule->spec.dev_class))
+			continue;
+		if((rule->spec.flags & USBLOG_RULE_SERIAL) && (!serial || strncmp(rule->spec.serial, serial, USBLOG_SERIAL_LEN)))
+			continue;
+		return rule;
+	}
+	return NULL;
+}
+
+
+//Put a new rule in a rule set, the set should be either private or protected by blocklist_mutex
+static int blocklist_insert(struct usblog_ruleset *set, const struct usblog_rule_spec *spec){
+	struct usblog_rule *rule;
+
+	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
+	if(!rule)
+		return -ENOMEM;
+	rule->hits = alloc_percpu(unsigned long);
+	if(!rule->hits){
+		kfree(rule);
+		return -ENOMEM;
+	}
+	rule->spec = *spec;
+	hash_add_rcu(set->table, &rule->node, blocklist_key(spec->vendor, spec->product));
+	WRITE_ONCE(set->count, set->count + 1);
+	return SUCCESS;
+}
+
+
+//Add a rule to the current rule set, the caller should hold blocklist_mutex
+int blocklist_add(const struct usblog_rule_spec *spec){
+	struct usblog_ruleset *set = rcu_dereference_protected(blocklist, lockdep_is_held(&blocklist_mutex));
+
+	//Adding the same rule twice does nothing
+	if(blocklist_find(set, spec))
+		return SUCCESS;
+	if(set->count >= blocklist_size)
+		return -ENOSPC;
+	return blocklist_insert(set, spec);
+}
+
+
+//Remove a rule from the current rule set, the caller should hold blocklist_mutex
+int blocklist_del(const struct usblog_rule_spec *spec){
+	struct usblog_ruleset *set = rcu_dereference_protected(blocklist, lockdep_is_held(&blocklist_mutex));
+	struct usblog_rule *rule = blocklist_find(set, spec);
+
+	if(!rule)
+		return -ENOENT;
+	hash_del_rcu(&rule->node);
+	WRITE_ONCE(set->count, set->count - 1);
+	//Readers might still be looking at it, so free it after a grace period
+	call_rcu(&rule->rcu, blocklist_free_rule_rcu);
+	return SUCCESS;
+}
+
+
+//Find the hit count of the rule which is the same as spec
+int blocklist_hits(const struct usblog_rule_spec *spec, u64 *hits){
+	struct usblog_rule *rule;
+	int err = -ENOENT;
+
+	mutex_lock(&blocklist_mutex);
+	rule = blocklist_find(rcu_dereference_protected(blocklist, lockdep_is_held(&blocklist_mutex)), spec);
+	if(rule){
+		*hits = blocklist_rule_hits(rule);
+		err = SUCCESS;
+	}
+	mutex_unlock(&blocklist_mutex);
+	return err;
+}
+
+
+//Publish a complete rule set in place of the current one, the readers see either the old or the new one
+static void blocklist_swap(struct usblog_ruleset *set){
+	struct usblog_ruleset *old;
+
+	mutex_lock(&blocklist_mutex);
+	old = rcu_dereference_protected(blocklist, lockdep_is_held(&blocklist_mutex));
+	rcu_assign_pointer(blocklist, set);
+	mutex_unlock(&blocklist_mutex);
+	//Wait for the readers of the old set before freeing it
+	synchronize_rcu();
+	blocklist_free(old);
+}
+
+
+//Replace the whole blocklist with an empty one
+int blocklist_reset(void){
+	struct usblog_ruleset *set = blocklist_alloc();
+
+	if(!set)
+		return -ENOMEM;
+	blocklist_swap(set);
+	return SUCCESS;
+}
+
+
+//Build a rule set from a batch and swap it in, the batch should already be copied to the kernel
+//Everything is checked and allocated before blocklist_mutex is taken, so the writers only wait for the swap
+//A bad rule fails the whole batch, the result fields say which one and why
+int blocklist_load(struct usblog_rule_batch *batch){
+	struct usblog_ruleset *set;
+	const struct usblog_rule_spec *spec;
+	unsigned int i;
+	int err = SUCCESS;
+
+	batch->loaded = 0;
+	batch->duplicates = 0;
+	batch->error_index = batch->count;
+	if(batch->magic != USBLOG_BATCH_MAGIC || batch->version != USBLOG_BATCH_VERSION || (batch->flags & ~USBLOG_BATCH_CHECK))
+		return batch->error = -EINVAL;
+
+	set = blocklist_alloc();
+	if(!set)
+		return batch->error = -ENOMEM;
+	for(i=0; i<batch->count; i++){
+		spec = &batch->rules[i];
+		if((spec->flags & ~(USBLOG_RULE_CLASS | USBLOG_RULE_SERIAL)) || spec->reserved[0] || spec->reserved[1])
+			err = -EINVAL;
+		//The same rule twice is not an error, just like blocklist_add
+		else if(blocklist_find(set, spec)){
+			batch->duplicates++;
+			continue;
+		}
+		else if(set->count >= blocklist_size)
+			err = -ENOSPC;
+		else
+			err = blocklist_insert(set, spec);
+		if(err){
+			batch->error_index = i;
+			break;
+		}
+	}
+	batch->loaded = set->count;
+	batch->error = err;
+
+	if(err || (batch->flags & USBLOG_BATCH_CHECK))
+		blocklist_free(set);
+	else
+		blocklist_swap(set);
+	return err;
+}
+
+
+//Number of rules in the blocklist
+unsigned int blocklist_count(void){
+	unsigned int count;
+
+	rcu_read_lock();
+	count = READ_ONCE(rcu_dereference(blocklist)->count);
+	rcu_read_unlock();
+	return count;
+}
+
+
+//Parse one rule written like "vendor:product [class|*] [serial]" with hexadecimal ids and class
+//For example "0781:5567", "0781:5567 08" or "0781:5567 * 4C530001"
+int blocklist_parse_rule(const char *line, struct usblog_rule_spec *spec){
+	char class_buf[3] = "";
+	int fields;
+
+	memset(spec, 0, sizeof(*spec));
+	fields = sscanf(line, "%hx:%hx %2s %31s", &spec->vendor, &spec->product, class_buf, spec->serial);
+	if(fields < 2)
+		return -EINVAL;
+	if(fields >= 3 && strcmp(class_buf, "*")){
+		if(kstrtou8(class_buf, 16, &spec->dev_class))
+			return -EINVAL;
+		spec->flags |= USBLOG_RULE_CLASS;
+	}
+	if(fields == 4)
+		spec->flags |= USBLOG_RULE_SERIAL;
+	return SUCCESS;
+}
+
+
+//Fill the blocklist part of the statistics, the caller adds the counters of matched and rejected devices
+void blocklist_fill_stats(struct usblog_dev_stats *stats){
+	memset(stats, 0, sizeof(*stats));
+	stats->version = USBLOG_STATS_VERSION;
+	stats->esize = sizeof(struct usblog_rule_spec);
+	stats->count = blocklist_count();
+	stats->size = blocklist_size;
+	stats->space = stats->size - min(stats->count, stats->size);
+	stats->full = stats->count >= stats->size;
+	stats->empty = stats->count == 0;
+}
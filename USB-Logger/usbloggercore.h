@@ -0,0 +1,124 @@
+//The storage core of the logger: per-CPU rings, the blocklist, the packed record format and the formatting of records
+//It is built into the module and, through usbloggershim.h, into a userspace library for the tools
+#ifndef USBLOGGERCORE_H
+#define USBLOGGERCORE_H
+
+#include "usbloggershim.h"
+#include "commonioctlcommands.h"
+
+//It is always good to have a meaningful constant as a return code
+#define SUCCESS 0
+//The blocklist hash table has 2^BLOCKLIST_HASH_BITS buckets
+#define BLOCKLIST_HASH_BITS 10
+
+//Blocked devices are kept in a hash table keyed on vendor:product
+//Readers (and usb_notify) only use RCU, writers are serialised by blocklist_mutex
+struct usblog_rule{
+	struct hlist_node node;
+	struct rcu_head rcu;
+	struct usblog_rule_spec spec;
+	//Each CPU counts its own matches, they are only summed when somebody asks
+	unsigned long __percpu *hits;
+};
+struct usblog_ruleset{
+	unsigned int count;
+	DECLARE_HASHTABLE(table, BLOCKLIST_HASH_BITS);
+};
+extern struct usblog_ruleset __rcu *blocklist;
+extern struct mutex blocklist_mutex;
+//Maximum number of rules in the blocklist
+extern unsigned int blocklist_size;
+
+//Each CPU owns one ring of preallocated records, so writers never allocate and never share a lock
+//All rings live in one area after a header page, so userspace could mmap the whole thing
+extern struct usblog_ring_header *log_header;
+extern struct usblog_record *log_records;
+extern size_t log_area_size;
+extern unsigned int ring_mask;
+//This is the only shared thing between writers, it orders the records of all CPUs
+//It lives in the header as head_seq, so mappers could see it too
+extern atomic64_t *log_sequence;
+
+//Records which leave the rings are packed into page sized blocks, a few bytes for each event
+//Sequence numbers and timestamps are varint deltas from the previous record, and the device fields
+//of a record are an index into the last USBLOG_PACK_DICT devices of the block when they are there
+//The block is only readable from its start, decoding replays the same state as the packing did
+#define USBLOG_PACK_DICT	8
+//No record takes more than this packed
+#define USBLOG_PACK_MAX		80
+struct usblog_pack_device{
+	u16 vendor;
+	u16 product;
+	u16 busnum;
+	u8 dev_class;
+	u8 speed;
+	u8 devnum;
+	u32 serial_hash;
+	u32 intf_classes;
+	char devpath[USBLOG_DEVPATH_LEN];
+};
+struct usblog_packer{
+	u64 seq, timestamp;
+	//Slot of the dictionary which is replaced next, and the number of slots in use
+	unsigned int next, used;
+	struct usblog_pack_device dict[USBLOG_PACK_DICT];
+};
+
+//Every archived chunk keeps a summary of its records, so queries could skip it without unpacking it
+//Vendors and vendor:product pairs go to small bloom filters, classes and actions to exact bitmaps
+//The times are signed like everywhere a query compares them, see log_replay_record
+#define ZONE_BLOOM_BITS 8
+struct usblog_zone{
+	s64 min_ts, max_ts;
+	u32 actions;
+	DECLARE_BITMAP(classes, 256);
+	//Interface classes of the class 0 devices, a query for a class matches them too
+	u32 intf_classes;
+	DECLARE_BITMAP(vendors, 1 << ZONE_BLOOM_BITS);
+	DECLARE_BITMAP(devices, 1 << ZONE_BLOOM_BITS);
+};
+
+//Formatting
+char identify_device_class_type(__u8 device_class);
+char identify_record_class_type(const struct usblog_record *rec);
+bool log_record_has_class(const struct usblog_record *rec, __u8 dev_class);
+const char *log_action_name(__u8 action);
+const char *log_flags_name(__u8 flags);
+
+//Rings, size should be a power of two and the area should be zeroed
+size_t log_ring_area_size(unsigned int size, unsigned int nr_rings);
+void log_ring_setup(void *area, unsigned int size, unsigned int nr_rings);
+void log_ring_store(struct usblog_record *event);
+u64 log_ring_stable_seq(void);
+int log_ring_collect(u64 from_seq, u64 last_seq, struct usblog_record *out, unsigned int max);
+unsigned long log_ring_count(u64 from_seq);
+u64 log_ring_oldest_seq(void);
+unsigned long log_ring_capacity(void);
+
+//Packed records, one packer should be initialised for each block and used in record order
+void log_pack_init(struct usblog_packer *packer);
+bool log_pack_record(struct usblog_packer *packer, const struct usblog_record *rec, u8 *block, size_t *len, size_t room);
+bool log_unpack_record(struct usblog_packer *packer, const u8 *block, size_t len, size_t *pos, struct usblog_record *rec);
+
+//Queries and zone maps, a zone should be initialised before the first record is added
+void log_replay_record(struct usblog_record *rec, s64 boot_delta);
+bool log_query_match(const struct usblog_query *query, const struct usblog_record *rec);
+void log_zone_init(struct usblog_zone *zone);
+void log_zone_add(struct usblog_zone *zone, const struct usblog_record *rec);
+bool log_zone_match(const struct usblog_zone *zone, const struct usblog_query *query);
+
+//Blocklist
+struct usblog_ruleset *blocklist_alloc(void);
+void blocklist_free(struct usblog_ruleset *set);
+u64 blocklist_rule_hits(struct usblog_rule *rule);
+struct usblog_rule *blocklist_match(const struct usblog_record *event, const char *serial);
+int blocklist_add(const struct usblog_rule_spec *spec);
+int blocklist_del(const struct usblog_rule_spec *spec);
+int blocklist_hits(const struct usblog_rule_spec *spec, u64 *hits);
+int blocklist_reset(void);
+int blocklist_load(struct usblog_rule_batch *batch);
+unsigned int blocklist_count(void);
+int blocklist_parse_rule(const char *line, struct usblog_rule_spec *spec);
+void blocklist_fill_stats(struct usblog_dev_stats *stats);
+
+#endif
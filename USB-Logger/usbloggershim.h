@@ -0,0 +1,204 @@
+//The core of the logger is built both into the kernel module and into a userspace library for the tools
+//In the kernel this header only pulls in the kernel headers the core needs,
+//in userspace it gives the same names on top of libc, pthreads and the GCC atomic builtins
+#ifndef USBLOGGERSHIM_H
+#define USBLOGGERSHIM_H
+
+#ifdef __KERNEL__
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/usb/ch9.h>
+
+#else
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include <linux/usb/ch9.h>
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s64 s64;
+
+#define S64_MAX ((s64) (~0ULL >> 1))
+#define S64_MIN (-S64_MAX - 1)
+#define min(a, b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(type, a, b) min((type) (a), (type) (b))
+#define max_t(type, a, b) max((type) (a), (type) (b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define BIT(n) (1UL << (n))
+#define __ffs(x) ((unsigned long) __builtin_ctzl(x))
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+//Memory, the flags are only there to keep the same calls
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kmalloc_array(n, size, gfp) calloc(n, size)
+#define kvzalloc(size, gfp) calloc(1, size)
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+
+static inline int kstrtou8(const char *s, unsigned int base, u8 *res){
+	char *end;
+	unsigned long value = strtoul(s, &end, base);
+
+	if(!*s || *end || value > 0xff)
+		return -EINVAL;
+	*res = value;
+	return 0;
+}
+
+//Memory ordering maps on the C11 fences, it is what the kernel barriers mean on a cache-coherent machine
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *) &(x) = (val))
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+typedef struct{
+	__s64 counter;
+} atomic64_t;
+#define atomic64_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+//Every thread of a tool plays one CPU, it should set usblog_shim_cpu to a different number below usblog_shim_nr_cpus
+//Then each ring still has only one writer, like a CPU with preemption disabled in the kernel
+extern __thread int usblog_shim_cpu;
+extern int usblog_shim_nr_cpus;
+#define nr_cpu_ids ((unsigned int) usblog_shim_nr_cpus)
+#define num_possible_cpus() nr_cpu_ids
+#define for_each_possible_cpu(cpu) for((cpu) = 0; (cpu) < usblog_shim_nr_cpus; (cpu)++)
+#define get_cpu() usblog_shim_cpu
+#define put_cpu() do{}while(0)
+#define __percpu
+#define alloc_percpu(type) ((type *) calloc(nr_cpu_ids, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (&(p)[cpu])
+#define this_cpu_inc(pcp) __atomic_add_fetch(&(&(pcp))[usblog_shim_cpu], 1, __ATOMIC_RELAXED)
+
+//The tools only change the blocklist before their threads start, so there is never a reader to wait for
+#define __rcu
+struct rcu_head{
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+#define rcu_read_lock() do{}while(0)
+#define rcu_read_unlock() do{}while(0)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_access_pointer(p) READ_ONCE(p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define synchronize_rcu() do{}while(0)
+#define call_rcu(head, fn) (fn)(head)
+#define lockdep_is_held(lock) 1
+
+struct mutex{
+	pthread_mutex_t lock;
+};
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+
+//The part of the kernel hlist and hashtable that the core uses, writers publish with a release store
+struct hlist_node{
+	struct hlist_node *next, **pprev;
+};
+struct hlist_head{
+	struct hlist_node *first;
+};
+
+static inline void hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h){
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	if(first)
+		first->pprev = &n->next;
+	__atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+}
+
+static inline void hlist_del_rcu(struct hlist_node *n){
+	struct hlist_node *next = n->next;
+
+	__atomic_store_n(n->pprev, next, __ATOMIC_RELEASE);
+	if(next)
+		next->pprev = n->pprev;
+}
+
+#define hlist_entry_safe(ptr, type, member) ({ __typeof__(ptr) __ptr = (ptr); __ptr ? container_of(__ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member) \
+	for(pos = hlist_entry_safe(__atomic_load_n(&(head)->first, __ATOMIC_ACQUIRE), __typeof__(*(pos)), member); pos; \
+		pos = hlist_entry_safe(__atomic_load_n(&(pos)->member.next, __ATOMIC_ACQUIRE), __typeof__(*(pos)), member))
+#define hlist_for_each_entry_rcu(pos, head, member) hlist_for_each_entry(pos, head, member)
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+	for(pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos && ({ n = pos->member.next; 1; }); \
+		pos = hlist_entry_safe(n, __typeof__(*(pos)), member))
+
+//Bitmaps of unsigned longs like in the kernel, the core only uses the non-atomic helpers
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+static inline void __set_bit(unsigned int nr, unsigned long *addr){
+	addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline bool test_bit(unsigned int nr, const unsigned long *addr){
+	return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline u32 hash_32(u32 val, unsigned int bits){
+	return (val * 0x61C88647U) >> (32 - bits);
+}
+
+#define DECLARE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name) (ARRAY_SIZE(name))
+#define HASH_BITS(name) ((unsigned int) __builtin_ctzl(HASH_SIZE(name)))
+#define hash_init(name) memset(name, 0, sizeof(name))
+#define hash_add_rcu(name, node, key) hlist_add_head_rcu(node, &name[hash_32(key, HASH_BITS(name))])
+#define hash_del_rcu(node) hlist_del_rcu(node)
+#define hash_for_each_possible(name, obj, member, key) \
+	hlist_for_each_entry(obj, &name[hash_32(key, HASH_BITS(name))], member)
+#define hash_for_each_possible_rcu(name, obj, member, key) hash_for_each_possible(name, obj, member, key)
+#define hash_for_each_rcu(name, bkt, obj, member) \
+	for((bkt) = 0; (bkt) < (int) HASH_SIZE(name); (bkt)++) \
+		hlist_for_each_entry(obj, &name[bkt], member)
+#define hash_for_each_safe(name, bkt, tmp, obj, member) \
+	for((bkt) = 0; (bkt) < (int) HASH_SIZE(name); (bkt)++) \
+		hlist_for_each_entry_safe(obj, tmp, &name[bkt], member)
+
+#endif
+
+#endif
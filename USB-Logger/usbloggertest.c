@@ -0,0 +1,130 @@
+//KUnit suite of what only the kernel could run: filling a record from a struct usb_device
+//It is built into the module with make kunit and runs when the module is loaded, under UML or QEMU for example
+//Synthetic devices are filled in on the stack of the test, the live log, blocklist and device table are never touched
+//Everything which works on records (rings, wraparound, blocklist, queries) is in tools/usblogtest instead
+#include <linux/version.h>
+
+//KUnit suites could only sit next to the module_init of their module since Linux 6.0
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#include <kunit/test.h>
+#include <linux/usb.h>
+#include <linux/jhash.h>
+
+#include "usbloggercore.h"
+#include "usbloggertest.h"
+
+#define TEST_VENDOR 0x0781
+#define TEST_PRODUCT 0x5567
+#define TEST_BUSNUM 3
+
+
+//A device with up to two interfaces in its active configuration, as the USB core passes it to the notifier
+struct test_device{
+	struct usb_device usbdev;
+	struct usb_bus bus;
+	struct usb_host_config config;
+	struct usb_interface intf[2];
+	struct usb_host_interface altsetting[2];
+};
+
+
+static struct test_device *test_device(struct kunit *test, u8 dev_class, const u8 *intf_classes, unsigned int nr_intf){
+	struct test_device *dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	unsigned int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+	dev->bus.busnum = TEST_BUSNUM;
+	dev->usbdev.bus = &dev->bus;
+	dev->usbdev.descriptor.idVendor = cpu_to_le16(TEST_VENDOR);
+	dev->usbdev.descriptor.idProduct = cpu_to_le16(TEST_PRODUCT);
+	dev->usbdev.descriptor.bDeviceClass = dev_class;
+	dev->usbdev.speed = USB_SPEED_HIGH;
+	dev->usbdev.devnum = 7;
+	strscpy(dev->usbdev.devpath, "1.4", sizeof(dev->usbdev.devpath));
+	dev->usbdev.state = USB_STATE_CONFIGURED;
+	dev->usbdev.actconfig = &dev->config;
+	dev->config.desc.bNumInterfaces = nr_intf;
+	for(i=0; i<nr_intf; i++){
+		dev->altsetting[i].desc.bInterfaceClass = intf_classes[i];
+		dev->intf[i].cur_altsetting = &dev->altsetting[i];
+		dev->config.interface[i] = &dev->intf[i];
+	}
+	return dev;
+}
+
+
+//Every field of the record comes from the device, a class 0 device is shown by its interface
+static void test_fill_device(struct kunit *test){
+	static const u8 classes[] = { USB_CLASS_MASS_STORAGE };
+	struct test_device *dev = test_device(test, USB_CLASS_PER_INTERFACE, classes, ARRAY_SIZE(classes));
+	struct usblog_record rec = {0};
+	char serial[] = "4C530001230101117093";
+
+	dev->usbdev.serial = serial;
+	log_test_fill_device(&rec, &dev->usbdev);
+	KUNIT_EXPECT_EQ(test, rec.vendor, (u16) TEST_VENDOR);
+	KUNIT_EXPECT_EQ(test, rec.product, (u16) TEST_PRODUCT);
+	KUNIT_EXPECT_EQ(test, rec.dev_class, (u8) USB_CLASS_PER_INTERFACE);
+	KUNIT_EXPECT_EQ(test, rec.speed, (u8) USB_SPEED_HIGH);
+	KUNIT_EXPECT_EQ(test, rec.busnum, (u16) TEST_BUSNUM);
+	KUNIT_EXPECT_EQ(test, rec.devnum, (u8) 7);
+	KUNIT_EXPECT_STREQ(test, rec.devpath, "1.4");
+	KUNIT_EXPECT_EQ(test, rec.serial_hash, jhash(serial, strlen(serial), 0));
+	KUNIT_EXPECT_EQ(test, rec.intf_classes, (u32) BIT(USB_CLASS_MASS_STORAGE));
+	KUNIT_EXPECT_EQ(test, identify_record_class_type(&rec), 'S');
+}
+
+
+//Classes above 30 share the last bit, and a record with it is not shown by its interface anymore
+static void test_fill_other_class(struct kunit *test){
+	static const u8 classes[] = { USB_CLASS_HID, USB_CLASS_VENDOR_SPEC };
+	struct test_device *dev = test_device(test, USB_CLASS_PER_INTERFACE, classes, ARRAY_SIZE(classes));
+	struct usblog_record rec = {0};
+
+	log_test_fill_device(&rec, &dev->usbdev);
+	KUNIT_EXPECT_EQ(test, rec.intf_classes, (u32) (BIT(USB_CLASS_HID) | BIT(USBLOG_INTF_OTHER)));
+	KUNIT_EXPECT_EQ(test, rec.serial_hash, 0U);
+	KUNIT_EXPECT_EQ(test, identify_record_class_type(&rec), 'N');
+}
+
+
+//usb_disconnect has dropped the configuration before the notifier runs, then there are no interfaces to walk
+static void test_fill_removed(struct kunit *test){
+	static const u8 classes[] = { USB_CLASS_HID };
+	struct test_device *dev = test_device(test, USB_CLASS_PER_INTERFACE, classes, ARRAY_SIZE(classes));
+	struct usblog_record rec = {0};
+
+	dev->usbdev.state = USB_STATE_NOTATTACHED;
+	dev->usbdev.actconfig = NULL;
+	log_test_fill_device(&rec, &dev->usbdev);
+	KUNIT_EXPECT_EQ(test, rec.vendor, (u16) TEST_VENDOR);
+	KUNIT_EXPECT_EQ(test, rec.intf_classes, 0U);
+}
+
+
+//An interface without an altsetting yet is skipped, not followed
+static void test_fill_no_altsetting(struct kunit *test){
+	static const u8 classes[] = { USB_CLASS_AUDIO, USB_CLASS_HID };
+	struct test_device *dev = test_device(test, USB_CLASS_PER_INTERFACE, classes, ARRAY_SIZE(classes));
+	struct usblog_record rec = {0};
+
+	dev->intf[0].cur_altsetting = NULL;
+	log_test_fill_device(&rec, &dev->usbdev);
+	KUNIT_EXPECT_EQ(test, rec.intf_classes, (u32) BIT(USB_CLASS_HID));
+}
+
+
+static struct kunit_case usblogger_test_cases[] = {
+	KUNIT_CASE(test_fill_device),
+	KUNIT_CASE(test_fill_other_class),
+	KUNIT_CASE(test_fill_removed),
+	KUNIT_CASE(test_fill_no_altsetting),
+	{}
+};
+
+static struct kunit_suite usblogger_test_suite = {
+	.name = "usblogger",
+	.test_cases = usblogger_test_cases,
+};
+kunit_test_suite(usblogger_test_suite);
+#endif
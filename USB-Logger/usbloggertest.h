@@ -0,0 +1,17 @@
+//Hooks of the module for the KUnit suite in usbloggertest.c
+//They only exist when the module is built with make kunit, a normal build has no test code at all
+//The rings, the blocklist and the queries are tested in userspace by tools/usblogtest, on rings of their own
+#ifndef USBLOGGERTEST_H
+#define USBLOGGERTEST_H
+
+#ifdef USBLOGGER_KUNIT
+#include <linux/types.h>
+#include "commonioctlcommands.h"
+
+struct usb_device;
+
+//Fill a record from a device like usb_notify does, nothing else is read or changed
+void log_test_fill_device(struct usblog_record *event, struct usb_device *usbdev);
+#endif
+
+#endif
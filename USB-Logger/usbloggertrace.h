@@ -0,0 +1,138 @@
+//Tracepoints of the USB logger, they could be used from perf, ftrace or bpftrace as usblogger:*
+//When a tracepoint is disabled it is only a static branch, the time stamps are not even read
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usblogger
+
+#if !defined(_USBLOGGER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USBLOGGER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "commonioctlcommands.h"
+
+//These are the readers which take a snapshot of the log
+#define USBLOGGER_READER_PROC	0
+#define USBLOGGER_READER_STREAM	1
+#define USBLOGGER_READER_DRAIN	2
+#define USBLOGGER_READER_QUERY	3
+
+//A record has been stored in a ring, duration is the time usb_notify spent on it
+TRACE_EVENT(usblogger_capture,
+	TP_PROTO(const struct usblog_record *rec, u64 duration),
+	TP_ARGS(rec, duration),
+	TP_STRUCT__entry(
+		__field(u64, seq)
+		__field(u64, timestamp)
+		__field(u64, duration)
+		__field(u16, vendor)
+		__field(u16, product)
+		__field(u16, busnum)
+		__field(u8, action)
+		__field(u8, dev_class)
+		__field(u8, flags)
+	),
+	TP_fast_assign(
+		__entry->seq = rec->seq;
+		__entry->timestamp = rec->timestamp;
+		__entry->duration = duration;
+		__entry->vendor = rec->vendor;
+		__entry->product = rec->product;
+		__entry->busnum = rec->busnum;
+		__entry->action = rec->action;
+		__entry->dev_class = rec->dev_class;
+		__entry->flags = rec->flags;
+	),
+	TP_printk("seq=%llu %04x:%04x bus=%u action=%u class=%02x flags=%02x duration=%lluns",
+		__entry->seq, __entry->vendor, __entry->product, __entry->busnum, __entry->action,
+		__entry->dev_class, __entry->flags, __entry->duration)
+);
+
+//Records have left the log before anybody discarded them
+//overwritten means the ring was too small for the log work, otherwise the retention limit dropped them
+TRACE_EVENT(usblogger_evict,
+	TP_PROTO(u64 first_seq, u64 count, bool overwritten),
+	TP_ARGS(first_seq, count, overwritten),
+	TP_STRUCT__entry(
+		__field(u64, first_seq)
+		__field(u64, count)
+		__field(bool, overwritten)
+	),
+	TP_fast_assign(
+		__entry->first_seq = first_seq;
+		__entry->count = count;
+		__entry->overwritten = overwritten;
+	),
+	TP_printk("first_seq=%llu count=%llu %s", __entry->first_seq, __entry->count,
+		__entry->overwritten ? "overwritten" : "retention")
+);
+
+//A new device matched a blocklist rule
+TRACE_EVENT(usblogger_block_match,
+	TP_PROTO(const struct usblog_record *rec, u8 rule_flags),
+	TP_ARGS(rec, rule_flags),
+	TP_STRUCT__entry(
+		__field(u16, vendor)
+		__field(u16, product)
+		__field(u8, dev_class)
+		__field(u8, rule_flags)
+		__field(bool, rejected)
+	),
+	TP_fast_assign(
+		__entry->vendor = rec->vendor;
+		__entry->product = rec->product;
+		__entry->dev_class = rec->dev_class;
+		__entry->rule_flags = rule_flags;
+		__entry->rejected = !!(rec->flags & USBLOG_FLAG_REJECTED);
+	),
+	TP_printk("%04x:%04x class=%02x rule_flags=%02x rejected=%d", __entry->vendor, __entry->product,
+		__entry->dev_class, __entry->rule_flags, __entry->rejected)
+);
+
+//A reader has copied records between from_seq and last_seq, duration is the whole read
+TRACE_EVENT(usblogger_snapshot,
+	TP_PROTO(unsigned int reader, u64 from_seq, u64 last_seq, unsigned int count, u64 duration),
+	TP_ARGS(reader, from_seq, last_seq, count, duration),
+	TP_STRUCT__entry(
+		__field(u64, from_seq)
+		__field(u64, last_seq)
+		__field(u64, duration)
+		__field(unsigned int, reader)
+		__field(unsigned int, count)
+	),
+	TP_fast_assign(
+		__entry->from_seq = from_seq;
+		__entry->last_seq = last_seq;
+		__entry->duration = duration;
+		__entry->reader = reader;
+		__entry->count = count;
+	),
+	TP_printk("reader=%s from_seq=%llu last_seq=%llu count=%u duration=%lluns",
+		__print_symbolic(__entry->reader, { USBLOGGER_READER_PROC, "proc" }, { USBLOGGER_READER_STREAM, "stream" },
+			{ USBLOGGER_READER_DRAIN, "drain" }, { USBLOGGER_READER_QUERY, "query" }),
+		__entry->from_seq, __entry->last_seq, __entry->count, __entry->duration)
+);
+
+//The blocklist has been changed through /proc/blockedusb, held is how long blocklist_mutex was taken
+TRACE_EVENT(usblogger_blocklist_write,
+	TP_PROTO(unsigned int rules, int err, u64 held),
+	TP_ARGS(rules, err, held),
+	TP_STRUCT__entry(
+		__field(u64, held)
+		__field(unsigned int, rules)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->held = held;
+		__entry->rules = rules;
+		__entry->err = err;
+	),
+	TP_printk("rules=%u err=%d held=%lluns", __entry->rules, __entry->err, __entry->held)
+);
+
+#endif
+
+//The header is not in include/trace/events, so tell define_trace.h where to find it
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbloggertrace
+#include <trace/define_trace.h>